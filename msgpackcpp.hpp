@@ -3,12 +3,25 @@
 #include <optional>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <tuple>
+#include <stdexcept>
+#include <array>
+#include <deque>
+#include <unordered_map>
+#include <initializer_list>
+#include <type_traits>
+#include <limits>
+#include <algorithm>
+#include <utility>
+#include <atomic>
+#include <memory>
+#include <thread>
 
 namespace {
     union DHelper {
         unsigned long long u;
-        float f;
+        double f;
     };
     union FHelper {
         unsigned int u;
@@ -75,6 +88,27 @@ namespace msgpackcpp {
         }
     };
 
+    class LimitError : public std::exception {
+        const char * msg;
+        size_t current;
+        size_t limit;
+
+    public:
+        explicit LimitError(const char * msg_, size_t cur_, size_t lim_) : msg(msg_), current(cur_), limit(lim_) { }
+
+        const char * what() const noexcept override {
+            return msg;
+        }
+
+        size_t getLimit() const noexcept {
+            return limit;
+        }
+
+        size_t getActual() const noexcept {
+            return current;
+        }
+    };
+
     class MutableView {
     public:
         char * data;
@@ -110,501 +144,1389 @@ namespace msgpackcpp {
 
     class Nil {};
 
-    class IStream {
-        ConstView data;
-        const char * current_position;
+    class Editor;
 
-        constexpr void check_eof(size_t n = 1) const {
-            if (current_position - data.data + n > data.size)
-                throw EOFError("EOF", data.size - (current_position - data.data), n);
+    template <class Tuple>
+    struct columns_of;
+
+    // Struct-of-arrays counterpart of a row tuple: std::tuple<A, B> -> std::tuple<std::vector<A>, std::vector<B>>
+    template <typename... Args>
+    struct columns_of<std::tuple<Args...>> {
+        using type = std::tuple<std::vector<Args>...>;
+    };
+
+    template <class Tuple>
+    using columns_t = typename columns_of<Tuple>::type;
+
+    // Field names of a struct encoded as a map, with a perfect hash found at compile time
+    template <size_t N>
+    class KeySet {
+        static constexpr size_t table_size = [] {
+            size_t n = 1;
+            while (n < 2 * N) {
+                n <<= 1u;
+            }
+            return n;
+        }();
+
+        std::array<std::string_view, N> names;
+        std::array<size_t, table_size> slots{};
+        std::array<size_t, N> order{};
+        unsigned long long seed = 0;
+
+        constexpr bool try_seed(unsigned long long seed_) {
+            for (auto & slot : slots) {
+                slot = N;
+            }
+            for (size_t i = 0; i != N; ++i) {
+                auto & slot = slots[hash(names[i], seed_) & (table_size - 1)];
+                if (slot != N) {
+                    return false;
+                }
+                slot = i;
+            }
+            seed = seed_;
+            return true;
         }
 
-        constexpr auto load_uint8() {
-            check_eof(1);
-            auto i = static_cast<unsigned char>(*++current_position);
-            return i;
+    public:
+        template <typename... Names>
+        explicit constexpr KeySet(Names... names_) : names{std::string_view(names_)...} {
+            static_assert(sizeof...(Names) == N);
+            for (size_t i = 0; i != N; ++i) {
+                for (size_t j = 0; j != i; ++j) {
+                    if (names[i] == names[j]) {
+                        throw std::logic_error("Duplicate key");
+                    }
+                }
+            }
+            for (size_t i = 0; i != N; ++i) {
+                size_t j = i;
+                for (; j != 0 && names[i] < names[order[j - 1]]; --j) {
+                    order[j] = order[j - 1];
+                }
+                order[j] = i;
+            }
+            unsigned long long candidate = 0;
+            while (!try_seed(candidate)) {
+                if (++candidate == (1ull << 16u)) {
+                    throw std::logic_error("No perfect hash found");
+                }
+            }
         }
 
-        constexpr auto load_uint16() {
-            check_eof(2);
-            auto i = (static_cast<unsigned short>(static_cast<unsigned char>(*++current_position)) << 8u);
-            i += (static_cast<unsigned char>(*++current_position));
-            return i;
+        static constexpr unsigned long long hash(std::string_view key, unsigned long long seed_) {
+            unsigned long long h = 14695981039346656037ull ^ (seed_ * 0x9E3779B97F4A7C15ull);
+            for (char c : key) {
+                h ^= static_cast<unsigned char>(c);
+                h *= 1099511628211ull;
+            }
+            return h ^ (h >> 29u);
         }
 
-        constexpr auto load_uint32() {
-            check_eof(4);
-            auto i = static_cast<unsigned int>(static_cast<unsigned char>(*++current_position)) << 24u;
-            i += (static_cast<unsigned int>(static_cast<unsigned char>(*++current_position)) << 16u);
-            i += (static_cast<unsigned int>(static_cast<unsigned char>(*++current_position)) << 8u);
-            i += (static_cast<unsigned char>(*++current_position));
-            return i;
+        // Index of key, or size() if it is not one of the names
+        constexpr size_t find(std::string_view key) const {
+            size_t i = slots[hash(key, seed) & (table_size - 1)];
+            if (i != N && names[i] == key) {
+                return i;
+            }
+            return N;
         }
 
-        constexpr auto load_uint64() {
-            check_eof(8);
-            auto i = (static_cast<unsigned long long>(static_cast<unsigned char>(*++current_position)) << 56u);
-            i += (static_cast<unsigned long long>(static_cast<unsigned char>(*++current_position)) << 48u);
-            i += (static_cast<unsigned long long>(static_cast<unsigned char>(*++current_position)) << 40u);
-            i += (static_cast<unsigned long long>(static_cast<unsigned char>(*++current_position)) << 32u);
-            i += (static_cast<unsigned long long>(static_cast<unsigned char>(*++current_position)) << 24u);
-            i += (static_cast<unsigned long long>(static_cast<unsigned char>(*++current_position)) << 16u);
-            i += (static_cast<unsigned long long>(static_cast<unsigned char>(*++current_position)) << 8u);
-            i += (static_cast<unsigned char>(*++current_position));
-            return i;
+        constexpr std::string_view operator[](size_t i) const {
+            return names[i];
         }
 
-        template <typename... Args, std::size_t... Idx>
-        constexpr IStream& tuple_stream_helper(std::tuple<Args...> &tuple, std::index_sequence<Idx...>) {
-            return (*this >> ... >> std::get<Idx>(tuple));
+        // Index of the i-th name in lexicographic order
+        constexpr size_t sorted(size_t i) const {
+            return order[i];
         }
 
-    public:
-        explicit constexpr IStream(ConstView cv) : data(cv), current_position(data.data) { }
+        static constexpr size_t size() {
+            return N;
+        }
+    };
 
-        constexpr IStream& operator>>(Nil &) {
-            check_eof();
-            switch (*current_position) {
-                case '\xc0':
-                    break;
-                default:
-                    throw TypeError("Expected nil", *current_position);
+    template <typename... Names>
+    KeySet(Names...) -> KeySet<sizeof...(Names)>;
+
+    struct InternedKey {
+        unsigned int id;
+        std::string_view name;
+    };
+
+    // Gives repeated dynamic map keys a stable id and a single shared copy of the string
+    class KeyInterner {
+        std::deque<std::string> storage;
+        std::unordered_map<std::string_view, unsigned int> ids;
+
+    public:
+        InternedKey intern(std::string_view key) {
+            auto it = ids.find(key);
+            if (it != ids.end()) {
+                return {it->second, it->first};
             }
-            ++current_position;
-            return *this;
+            auto id = static_cast<unsigned int>(storage.size());
+            std::string_view name = storage.emplace_back(key);
+            ids.emplace(name, id);
+            return {id, name};
         }
 
-        constexpr IStream& operator>>(bool & b) {
-            check_eof();
-            switch (*current_position) {
-                case '\xc2':
-                    b = false;
-                    break;
-                case '\xc3':
-                    b = true;
-                    break;
-                default:
-                    throw TypeError("Expected bool", *current_position);
-            }
-            ++current_position;
-            return *this;
+        std::string_view name(unsigned int id) const {
+            return storage[id];
         }
 
-        constexpr IStream& operator>>(long long & i) {
-            check_eof();
-            switch (*current_position) {
-                case '\xcc':
-                    i = load_uint8();
-                    break;
-                case '\xcd':
-                    i = load_uint16();
-                    break;
-                case '\xce':
-                    i = load_uint32();
-                    break;
-                case '\xcf':
-                    i = load_uint64();
-                    break;
-                case '\xd0':
-                    i = static_cast<char>(load_uint8());
-                    break;
-                case '\xd1':
-                    i = static_cast<short>(load_uint16());
-                    break;
-                case '\xd2':
-                    i = static_cast<int>(load_uint32());
-                    break;
-                case '\xd3':
-                    i = static_cast<long long>(load_uint64());
-                    break;
+        size_t size() const {
+            return storage.size();
+        }
+    };
+
+    enum class TypeClass : unsigned char {
+        Nil,
+        Bool,
+        Int,
+        Float,
+        Str,
+        Bin,
+        Array,
+        Map,
+        Ext,
+        Invalid,
+    };
+
+    // Class of every format byte, so classifying a value in the Stats hooks is a single load
+    inline constexpr std::array<TypeClass, 256> type_classes = [] {
+        auto classify = [](unsigned char format) {
+            if (format <= 0x7Fu || format >= 0xE0u) {
+                return TypeClass::Int;
+            }
+            if (format <= 0x8Fu) {
+                return TypeClass::Map;
+            }
+            if (format <= 0x9Fu) {
+                return TypeClass::Array;
+            }
+            if (format <= 0xBFu) {
+                return TypeClass::Str;
+            }
+            switch (format) {
+                case 0xc0:
+                    return TypeClass::Nil;
+                case 0xc2: case 0xc3:
+                    return TypeClass::Bool;
+                case 0xc4: case 0xc5: case 0xc6:
+                    return TypeClass::Bin;
+                case 0xc7: case 0xc8: case 0xc9: case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+                    return TypeClass::Ext;
+                case 0xca: case 0xcb:
+                    return TypeClass::Float;
+                case 0xd9: case 0xda: case 0xdb:
+                    return TypeClass::Str;
+                case 0xdc: case 0xdd:
+                    return TypeClass::Array;
+                case 0xde: case 0xdf:
+                    return TypeClass::Map;
+                case 0xc1:
+                    return TypeClass::Invalid;
                 default:
-                    if ((static_cast<unsigned char>(*current_position) & 0x80u) == 0x00u) {
-                        i = static_cast<unsigned char>(*current_position);
-                    } else if ((static_cast<unsigned char>(*current_position) & 0xE0u) == 0xE0u) {
-                        i = -static_cast<int>((1u << 5u) - static_cast<int>(static_cast<unsigned char>(*current_position) & 0x1Fu));
-                    } else {
-                        throw TypeError("Expected integer", *current_position);
-                    }
+                    return TypeClass::Int;
             }
-            ++current_position;
-            return *this;
+        };
+        std::array<TypeClass, 256> classes{};
+        for (size_t f = 0; f != classes.size(); ++f) {
+            classes[f] = classify(static_cast<unsigned char>(f));
         }
+        return classes;
+    }();
 
-        constexpr IStream& operator>>(unsigned long long & i) {
-            check_eof();
-            switch (*current_position) {
-                case '\xcc':
-                    i = load_uint8();
-                    break;
-                case '\xcd':
-                    i = load_uint16();
-                    break;
-                case '\xce':
-                    i = load_uint32();
-                    break;
-                case '\xcf':
-                    i = load_uint64();
-                    break;
-                case '\xd0':
-                    i = static_cast<char>(load_uint8());
-                    break;
-                case '\xd1':
-                    i = static_cast<short>(load_uint16());
-                    break;
-                case '\xd2':
-                    i = static_cast<int>(load_uint32());
-                    break;
-                case '\xd3':
-                    i = static_cast<long long>(load_uint64());
-                    break;
-                default:
-                    if ((static_cast<unsigned char>(*current_position) & 0x80u) == 0x00u) {
-                        i = static_cast<unsigned char>(*current_position);
-                    } else if ((static_cast<unsigned char>(*current_position) & 0xE0u) == 0xE0u) {
-                        i = -static_cast<int>((1u << 5u) - static_cast<int>(static_cast<unsigned char>(*current_position) & 0x1Fu));
-                    } else {
-                        throw TypeError("Expected integer", *current_position);
-                    }
+    constexpr TypeClass type_class(unsigned char format) {
+        return type_classes[format];
+    }
+
+    // Instrumentation policy of IStream / OStream that records nothing; every hook compiles away
+    struct NoStats {
+        constexpr void on_value(unsigned char, size_t) { }
+
+        constexpr void on_allocation(size_t) { }
+
+        constexpr void on_container(size_t) { }
+
+        constexpr void on_bytes(size_t) { }
+
+        constexpr void on_enter() { }
+
+        constexpr void on_leave() { }
+
+        template <class E>
+        constexpr void on_error(const E &) { }
+
+        constexpr void on_begin_value() { }
+
+        constexpr void on_byte(char) { }
+
+        constexpr void on_end_value() { }
+    };
+
+    // Counting policy: IStream<Stats> / OStream<MV, E, Stats>. Keep one per thread and merge with +=.
+    class Stats {
+        size_t depth = 0;
+        size_t value_bytes = 0;
+        unsigned char lead = 0;
+        bool in_value = false;
+
+    public:
+        std::array<unsigned long long, 256> values_by_format{};
+        std::array<unsigned long long, static_cast<size_t>(TypeClass::Invalid) + 1> bytes_by_class{};
+        unsigned long long allocations = 0;
+        unsigned long long allocated_bytes = 0;
+        size_t max_depth = 0;
+        unsigned long long type_errors = 0;
+        unsigned long long length_errors = 0;
+        unsigned long long eof_errors = 0;
+        unsigned long long limit_errors = 0;
+
+        unsigned long long values(TypeClass c) const {
+            unsigned long long n = 0;
+            for (size_t f = 0; f != values_by_format.size(); ++f) {
+                if (type_class(static_cast<unsigned char>(f)) == c) {
+                    n += values_by_format[f];
+                }
             }
-            ++current_position;
-            return *this;
+            return n;
         }
 
-        constexpr IStream& operator>>(int & i) {
-            check_eof();
-            switch (*current_position) {
-                case '\xcc':
-                    i = load_uint8();
-                    break;
-                case '\xcd':
-                    i = load_uint16();
-                    break;
-                case '\xce':
-                    i = load_uint32();
-                    break;
-                case '\xd0':
-                    i = static_cast<char>(load_uint8());
-                    break;
-                case '\xd1':
-                    i = static_cast<short>(load_uint16());
-                    break;
-                case '\xd2':
-                    i = static_cast<int>(load_uint32());
-                    break;
-                default:
-                    if ((static_cast<unsigned char>(*current_position) & 0x80u) == 0x00u) {
-                        i = static_cast<unsigned char>(*current_position);
-                    } else if ((static_cast<unsigned char>(*current_position) & 0xE0u) == 0xE0u) {
-                        i = -static_cast<int>((1u << 5u) - static_cast<int>(static_cast<unsigned char>(*current_position) & 0x1Fu));
-                    } else {
-                        throw TypeError("Expected integer", *current_position);
-                    }
+        unsigned long long bytes(TypeClass c) const {
+            return bytes_by_class[static_cast<size_t>(c)];
+        }
+
+        Stats & operator+=(const Stats & other) {
+            for (size_t i = 0; i != values_by_format.size(); ++i) {
+                values_by_format[i] += other.values_by_format[i];
             }
-            ++current_position;
+            for (size_t i = 0; i != bytes_by_class.size(); ++i) {
+                bytes_by_class[i] += other.bytes_by_class[i];
+            }
+            allocations += other.allocations;
+            allocated_bytes += other.allocated_bytes;
+            max_depth = std::max(max_depth, other.max_depth);
+            type_errors += other.type_errors;
+            length_errors += other.length_errors;
+            eof_errors += other.eof_errors;
+            limit_errors += other.limit_errors;
             return *this;
         }
 
-        constexpr IStream& operator>>(unsigned int & i) {
-            check_eof();
-            switch (*current_position) {
-                case '\xcc':
-                    i = load_uint8();
-                    break;
-                case '\xcd':
-                    i = load_uint16();
-                    break;
-                case '\xce':
-                    i = load_uint32();
-                    break;
-                case '\xd0':
-                    i = static_cast<char>(load_uint8());
-                    break;
-                case '\xd1':
-                    i = static_cast<short>(load_uint16());
-                    break;
-                case '\xd2':
-                    i = static_cast<int>(load_uint32());
-                    break;
-                default:
-                    if ((static_cast<unsigned char>(*current_position) & 0x80u) == 0x00u) {
-                        i = static_cast<unsigned char>(*current_position);
-                    } else if ((static_cast<unsigned char>(*current_position) & 0xE0u) == 0xE0u) {
-                        i = -static_cast<int>((1u << 5u) - static_cast<int>(static_cast<unsigned char>(*current_position) & 0x1Fu));
-                    } else {
-                        throw TypeError("Expected integer", *current_position);
-                    }
+        // Decoder hooks: one call per decoded value (container headers count as their own bytes)
+        void on_value(unsigned char format, size_t bytes) {
+            ++values_by_format[format];
+            bytes_by_class[static_cast<size_t>(type_class(format))] += bytes;
+        }
+
+        void on_allocation(size_t bytes) {
+            ++allocations;
+            allocated_bytes += bytes;
+        }
+
+        void on_container(size_t) { }
+
+        void on_bytes(size_t) { }
+
+        void on_enter() {
+            max_depth = std::max(max_depth, ++depth);
+        }
+
+        void on_leave() {
+            if (depth != 0) {
+                --depth;
             }
-            ++current_position;
-            return *this;
         }
 
-        constexpr IStream& operator>>(short & i) {
-            check_eof();
-            switch (*current_position) {
-                case '\xcc':
-                    i = load_uint8();
-                    break;
-                case '\xcd':
-                    i = load_uint16();
-                    break;
-                case '\xd0':
-                    i = static_cast<char>(load_uint8());
-                    break;
-                case '\xd1':
-                    i = static_cast<short>(load_uint16());
-                    break;
-                default:
-                    if ((static_cast<unsigned char>(*current_position) & 0x80u) == 0x00u) {
-                        i = static_cast<unsigned char>(*current_position);
-                    } else if ((static_cast<unsigned char>(*current_position) & 0xE0u) == 0xE0u) {
-                        i = -static_cast<int>((1u << 5u) - static_cast<int>(static_cast<unsigned char>(*current_position) & 0x1Fu));
-                    } else {
-                        throw TypeError("Expected integer", *current_position);
-                    }
+        void on_error(const TypeError &) {
+            ++type_errors;
+        }
+
+        void on_error(const LengthError &) {
+            ++length_errors;
+        }
+
+        void on_error(const EOFError &) {
+            ++eof_errors;
+        }
+
+        void on_error(const LimitError &) {
+            ++limit_errors;
+        }
+
+        // Encoder hooks: the first byte written after on_begin_value is the format byte
+        void on_begin_value() {
+            in_value = true;
+            value_bytes = 0;
+        }
+
+        void on_byte(char c) {
+            if (value_bytes++ == 0) {
+                lead = static_cast<unsigned char>(c);
             }
-            ++current_position;
-            return *this;
         }
 
-        constexpr IStream& operator>>(unsigned short & i) {
-            check_eof();
-            switch (*current_position) {
-                case '\xcc':
-                    i = load_uint8();
-                    break;
-                case '\xcd':
-                    i = load_uint16();
-                    break;
-                case '\xd0':
-                    i = static_cast<char>(load_uint8());
-                    break;
-                case '\xd1':
-                    i = static_cast<short>(load_uint16());
-                    break;
-                default:
-                    if ((static_cast<unsigned char>(*current_position) & 0x80u) == 0x00u) {
-                        i = static_cast<unsigned char>(*current_position);
-                    } else if ((static_cast<unsigned char>(*current_position) & 0xE0u) == 0xE0u) {
-                        i = -static_cast<int>((1u << 5u) - static_cast<int>(static_cast<unsigned char>(*current_position) & 0x1Fu));
-                    } else {
-                        throw TypeError("Expected integer", *current_position);
-                    }
+        void on_end_value() {
+            if (in_value) {
+                on_value(lead, value_bytes);
+                in_value = false;
             }
-            ++current_position;
-            return *this;
         }
+    };
 
-        constexpr IStream& operator>>(signed char & i) {
-            check_eof();
-            switch (*current_position) {
-                case '\xcc':
-                    i = load_uint8();
-                    break;
-                case '\xd0':
-                    i = static_cast<char>(load_uint8());
-                    break;
-                default:
-                    if ((static_cast<unsigned char>(*current_position) & 0x80u) == 0x00u) {
-                        i = static_cast<unsigned char>(*current_position);
-                    } else if ((static_cast<unsigned char>(*current_position) & 0xE0u) == 0xE0u) {
-                        i = -static_cast<int>((1u << 5u) - static_cast<int>(static_cast<unsigned char>(*current_position) & 0x1Fu));
-                    } else {
-                        throw TypeError("Expected integer", *current_position);
-                    }
+    // User types plug in by declaring, next to the type (found by ADL), either or both of
+    //     void msgpack_pack(Stream & os, const T & value);   // os << field << ...
+    //     void msgpack_unpack(Stream & is, T & value);       // is >> field >> ...
+    // usually as templates over Stream, so one hook serves every sink, policy and encoding.
+    template <class Stream, class T, class = void>
+    struct has_msgpack_pack : std::false_type { };
+
+    template <class Stream, class T>
+    struct has_msgpack_pack<Stream, T, std::void_t<decltype(msgpack_pack(std::declval<Stream &>(), std::declval<const T &>()))>>
+        : std::true_type { };
+
+    template <class Stream, class T, class = void>
+    struct has_msgpack_unpack : std::false_type { };
+
+    template <class Stream, class T>
+    struct has_msgpack_unpack<Stream, T, std::void_t<decltype(msgpack_unpack(std::declval<Stream &>(), std::declval<T &>()))>>
+        : std::true_type { };
+
+    struct Limits {
+        size_t max_depth = std::numeric_limits<size_t>::max();
+        // Sum of all array and map lengths seen while decoding; string and binary lengths do not count
+        size_t max_elements = std::numeric_limits<size_t>::max();
+        // Total bytes the decoder may allocate
+        size_t max_allocated = std::numeric_limits<size_t>::max();
+        // Longest single array or map (elements), string or binary (bytes)
+        size_t max_container = std::numeric_limits<size_t>::max();
+    };
+
+    // Policy that enforces Limits on untrusted input; every check runs before the matching allocation.
+    // Wrap another policy to keep collecting it: IStream<Budget<Stats>>.
+    template <class Inner = NoStats>
+    class Budget : public Inner {
+        Limits limits;
+        size_t depth = 0;
+        size_t elements = 0;
+        size_t allocated = 0;
+
+        template <class E, class... Args>
+        [[noreturn, gnu::cold, gnu::noinline]] constexpr void fail(Args... args) {
+            E e(args...);
+            Inner::on_error(e);
+            throw e;
+        }
+
+    public:
+        constexpr Budget() = default;
+
+        explicit constexpr Budget(Limits limits_, Inner inner = Inner()) : Inner(std::move(inner)), limits(limits_) { }
+
+        constexpr const Limits & get_limits() const {
+            return limits;
+        }
+
+        constexpr void on_container(size_t size) {
+            if (size > limits.max_container) {
+                fail<LimitError>("Container too large", size, limits.max_container);
             }
-            ++current_position;
-            return *this;
+            elements += size;
+            if (elements > limits.max_elements) {
+                fail<LimitError>("Too many elements", elements, limits.max_elements);
+            }
+            Inner::on_container(size);
         }
 
-        constexpr IStream& operator>>(unsigned char & i) {
-            check_eof();
-            switch (*current_position) {
-                case '\xcc':
-                    i = load_uint8();
-                    break;
-                case '\xd0':
-                    i = static_cast<char>(load_uint8());
-                    break;
-                default:
-                    if ((static_cast<unsigned char>(*current_position) & 0x80u) == 0x00u) {
-                        i = static_cast<unsigned char>(*current_position);
-                    } else if ((static_cast<unsigned char>(*current_position) & 0xE0u) == 0xE0u) {
-                        i = -static_cast<int>((1u << 5u) -
-                                              static_cast<int>(static_cast<unsigned char>(*current_position) & 0x1Fu));
-                    } else {
-                        throw TypeError("Expected integer", *current_position);
-                    }
+        constexpr void on_bytes(size_t size) {
+            if (size > limits.max_container) {
+                fail<LimitError>("Container too large", size, limits.max_container);
             }
-            ++current_position;
-            return *this;
+            Inner::on_bytes(size);
         }
 
-        constexpr IStream& operator>>(float & i) {
-            check_eof();
-            switch (*current_position) {
-                case '\xca': {
-                    FHelper bin_val{};
-                    bin_val.u = load_uint32();
-                    static_assert(sizeof(bin_val.u) == sizeof(i));
-                    i = bin_val.f;
-                }
-                    break;
-                default:
-                    throw TypeError("Expected float", *current_position);
+        constexpr void on_allocation(size_t bytes) {
+            if (bytes > limits.max_allocated - allocated) {
+                fail<LimitError>("Allocation budget exceeded", allocated + bytes, limits.max_allocated);
             }
-            ++current_position;
-            return *this;
+            allocated += bytes;
+            Inner::on_allocation(bytes);
         }
 
-        constexpr IStream& operator>>(double & i) {
-            check_eof();
-            switch (*current_position) {
-                case '\xcb': {
-                    DHelper bin_val{};
-                    bin_val.u = load_uint32();
-                    static_assert(sizeof(bin_val.u) == sizeof(i));
-                    i = bin_val.f;
-                }
-                    break;
-                default:
-                    throw TypeError("Expected double", *current_position);
+        constexpr void on_enter() {
+            if (++depth > limits.max_depth) {
+                fail<LimitError>("Nesting too deep", depth, limits.max_depth);
             }
-            ++current_position;
-            return *this;
+            Inner::on_enter();
         }
 
-        IStream& operator>>(std::string & s) {
-            check_eof();
-            size_t size = 0;
-            switch (*current_position) {
-                case '\xd9':
-                    size = load_uint8();
-                    break;
-                case '\xda':
-                    size = load_uint16();
-                    break;
-                case '\xdb':
-                    size = load_uint32();
-                    break;
-                default:
-                    if ((static_cast<unsigned char>(*current_position) & 0xE0u) == 0xA0u) {
-                        size = static_cast<unsigned char>(*current_position) & 0x1Fu;
-                    } else {
-                        throw TypeError("Expected string", *current_position);
-                    }
+        constexpr void on_leave() {
+            if (depth != 0) {
+                --depth;
             }
-            ++current_position;
-            check_eof(size);
-            s = std::string(current_position, size);
-            current_position += size;
-            return *this;
+            Inner::on_leave();
         }
+    };
 
-        IStream& operator>>(std::vector<char> & s) {
-            check_eof();
-            size_t size = 0;
-            switch (*current_position) {
-                case '\xc4':
-                    size = load_uint8();
-                    break;
-                case '\xc5':
-                    size = load_uint16();
-                    break;
-                case '\xc6':
-                    size = load_uint32();
+    // Containers an IStream has entered and not yet left, so restore() can unwind its policy after a failed
+    // read. Stateless policies have nothing to unwind and keep IStream at its bare size.
+    template <bool Tracked>
+    struct NestingDepth {
+        size_t entered = 0;
+    };
+
+    template <>
+    struct NestingDepth<false> { };
+
+    template <class Policy = NoStats>
+    class IStream : private Policy, private NestingDepth<!std::is_empty_v<Policy>> {
+        friend class Editor;
+
+        static constexpr bool tracks_depth = !std::is_empty_v<Policy>;
+
+        ConstView data;
+        const char * current_position;
+
+        // Error path, kept out of line so the throw does not bloat every decoder it is inlined into; the
+        // error is built here, so callers only pass its scalar arguments
+        template <class E, class... Args>
+        [[noreturn, gnu::cold, gnu::noinline]] constexpr void fail(Args... args) {
+            E e(args...);
+            Policy::on_error(e);
+            throw e;
+        }
+
+        [[gnu::always_inline]] constexpr void record(const char * start) {
+            Policy::on_value(static_cast<unsigned char>(*start), current_position - start);
+        }
+
+        constexpr size_t nesting() const {
+            if constexpr (tracks_depth) {
+                return this->entered;
+            } else {
+                return 0;
+            }
+        }
+
+        [[gnu::always_inline]] constexpr void enter() {
+            if constexpr (tracks_depth) {
+                ++this->entered;
+            }
+            Policy::on_enter();
+        }
+
+        [[gnu::always_inline]] constexpr void leave() {
+            if constexpr (tracks_depth) {
+                --this->entered;
+            }
+            Policy::on_leave();
+        }
+
+        [[noreturn, gnu::cold, gnu::noinline]] constexpr void fail_eof(size_t n) {
+            fail<EOFError>("EOF", data.size - (current_position - data.data), n);
+        }
+
+        [[gnu::always_inline]] constexpr void check_eof(size_t n = 1) {
+            if (current_position - data.data + n > data.size)
+                fail_eof(n);
+        }
+
+        [[gnu::always_inline]] constexpr auto load_uint8() {
+            check_eof(1);
+            auto i = static_cast<unsigned char>(*++current_position);
+            return i;
+        }
+
+        // Big-endian field after the format byte; a loop keeps the inlining estimate of every read that uses it
+        // small, and unrolling it early lets the shifts still fold into a single byte swap
+        template <typename T>
+        [[gnu::always_inline]] constexpr T load_big_endian() {
+            check_eof(sizeof(T));
+            T i = 0;
+#pragma GCC unroll 8
+            for (size_t k = 0; k != sizeof(T); ++k) {
+                i = static_cast<T>(i << 8u) | static_cast<unsigned char>(*++current_position);
+            }
+            return i;
+        }
+
+        [[gnu::always_inline]] constexpr auto load_uint16() {
+            return load_big_endian<unsigned short>();
+        }
+
+        [[gnu::always_inline]] constexpr auto load_uint32() {
+            return load_big_endian<unsigned int>();
+        }
+
+        [[gnu::always_inline]] constexpr auto load_uint64() {
+            return load_big_endian<unsigned long long>();
+        }
+
+        template <typename... Args, std::size_t... Idx>
+        constexpr IStream& tuple_stream_helper(std::tuple<Args...> &tuple, std::index_sequence<Idx...>) {
+            return (*this >> ... >> std::get<Idx>(tuple));
+        }
+
+        [[gnu::always_inline]] constexpr size_t load_array_header() {
+            check_eof();
+            auto c = static_cast<unsigned char>(*current_position);
+            size_t size = (c & 0xF0u) == 0x90u ? c & 0x0Fu : load_length(c, 0xdc, 0xdd, "Expected array");
+            ++current_position;
+            return size;
+        }
+
+        [[gnu::always_inline]] constexpr size_t load_map_header() {
+            check_eof();
+            auto c = static_cast<unsigned char>(*current_position);
+            size_t size = (c & 0xF0u) == 0x80u ? c & 0x0Fu : load_length(c, 0xde, 0xdf, "Expected map");
+            ++current_position;
+            return size;
+        }
+
+        // Length field of a sized header: format byte last takes 32 bits and each one before it half that,
+        // down to first. Kept out of line, as the fixed-size forms are the common case.
+        [[gnu::noinline]] constexpr size_t load_length(unsigned char c, unsigned char first, unsigned char last,
+                                                       const char * expected) {
+            if (c < first || c > last) {
+                fail<TypeError>(expected, c);
+            }
+            switch (last - c) {
+                case 0:
+                    return load_uint32();
+                case 1:
+                    return load_uint16();
+                default:
+                    return load_uint8();
+            }
+        }
+
+        template <typename... Args, std::size_t... Idx>
+        constexpr void struct_field_helper(std::tuple<Args&...> &fields, size_t i, std::index_sequence<Idx...>) {
+            ((i == Idx ? (void)(*this >> std::get<Idx>(fields)) : void()), ...);
+        }
+
+        [[gnu::always_inline]] constexpr size_t decode_array_header() {
+            const char * start = current_position;
+            size_t size = load_array_header();
+            record(start);
+            Policy::on_container(size);
+            return size;
+        }
+
+        [[gnu::always_inline]] constexpr size_t decode_map_header() {
+            const char * start = current_position;
+            size_t size = load_map_header();
+            record(start);
+            Policy::on_container(size);
+            return size;
+        }
+
+        // The float width other than the destination's, kept out of line like load_integer
+        [[gnu::noinline]] constexpr float load_double_as_float() {
+            const char * start = current_position;
+            if (*current_position != '\xcb') {
+                fail<TypeError>("Expected float", *current_position);
+            }
+            DHelper bin_val{};
+            bin_val.u = load_uint64();
+            auto f = static_cast<float>(bin_val.f);
+            if (bin_val.f == bin_val.f && static_cast<double>(f) != bin_val.f) {
+                current_position = start;
+                fail<TypeError>("Double does not fit in float", *start);
+            }
+            return f;
+        }
+
+        [[gnu::noinline]] constexpr double load_float_as_double() {
+            if (*current_position != '\xca') {
+                fail<TypeError>("Expected double", *current_position);
+            }
+            FHelper bin_val{};
+            bin_val.u = load_uint32();
+            return bin_val.f;
+        }
+
+        // Fixints decode inline; the wider formats go through load_integer, kept out of line so every
+        // inlined integer read stays small
+        template <typename T>
+        [[gnu::always_inline]] constexpr IStream& decode_integer(T & i) {
+            check_eof();
+            const char * start = current_position;
+            auto c = static_cast<unsigned char>(*current_position);
+            if (c < 0x80u) {
+                i = static_cast<T>(c);
+            } else if (c >= 0xe0u) {
+                i = static_cast<T>(static_cast<signed char>(c));
+            } else {
+                i = static_cast<T>(load_integer<T>());
+            }
+            ++current_position;
+            record(start);
+            return *this;
+        }
+
+        // Sized integer formats T can hold, sign-extended to 64 bits for the signed ones
+        template <typename T>
+        [[gnu::noinline]] constexpr unsigned long long load_integer() {
+            auto c = static_cast<unsigned char>(*current_position);
+            if (!accepts<T>(c)) {
+                fail<TypeError>("Expected integer", *current_position);
+            }
+            switch (c) {
+                case 0xcc:
+                    return load_uint8();
+                case 0xcd:
+                    return load_uint16();
+                case 0xce:
+                    return load_uint32();
+                case 0xcf:
+                    return load_uint64();
+                case 0xd0:
+                    return static_cast<unsigned long long>(static_cast<signed char>(load_uint8()));
+                case 0xd1:
+                    return static_cast<unsigned long long>(static_cast<short>(load_uint16()));
+                case 0xd2:
+                    return static_cast<unsigned long long>(static_cast<int>(load_uint32()));
+                default:
+                    return load_uint64();
+            }
+        }
+
+        template <typename T>
+        void column_push(std::vector<T> & column) {
+            *this >> column.emplace_back();
+        }
+
+        void column_push(std::vector<bool> & column) {
+            bool b = false;
+            *this >> b;
+            column.push_back(b);
+        }
+
+        // Whether operator>> for T takes a value starting with format byte c
+        template <typename T>
+        static constexpr bool accepts(unsigned char c) {
+            if constexpr (std::is_same_v<T, Nil>) {
+                return c == 0xc0;
+            } else if constexpr (std::is_same_v<T, bool>) {
+                return c == 0xc2 || c == 0xc3;
+            } else if constexpr (std::is_integral_v<T>) {
+                if (c < 0x80u || c >= 0xe0u) {
+                    return true;
+                }
+                if (c >= 0xcc && c <= 0xcf) {
+                    return (1u << (c - 0xccu)) <= sizeof(T);
+                }
+                return c >= 0xd0 && c <= 0xd3 && (1u << (c - 0xd0u)) <= sizeof(T);
+            } else if constexpr (std::is_same_v<T, float> || std::is_same_v<T, double>) {
+                return c == 0xca || c == 0xcb;
+            } else if constexpr (std::is_same_v<T, std::string> || std::is_same_v<T, std::string_view>) {
+                return (c & 0xE0u) == 0xA0u || (c >= 0xd9 && c <= 0xdb);
+            } else if constexpr (std::is_same_v<T, std::vector<char>>) {
+                return c >= 0xc4 && c <= 0xc6;
+            } else {
+                static_assert(sizeof(T) == 0, "try_read does not support this type");
+            }
+        }
+
+        template <typename T>
+        bool try_unpack(T & value) {
+            Checkpoint cp = checkpoint();
+            try {
+                msgpack_unpack(*this, value);
+                return true;
+            } catch (const TypeError &) {
+            } catch (const LengthError &) {
+            } catch (const EOFError &) {
+            }
+            restore(cp);
+            return false;
+        }
+
+        template <typename Tuple, size_t... I>
+        constexpr bool try_read_tuple(Tuple & tuple, std::index_sequence<I...>) {
+            Checkpoint cp = checkpoint();
+            if (current_position == data.data + data.size) {
+                return false;
+            }
+            auto c = static_cast<unsigned char>(*current_position);
+            size_t header = c == 0xdc ? 2 : c == 0xdd ? 4 : 0;
+            if (((c & 0xF0u) != 0x90u && header == 0) ||
+                static_cast<size_t>(data.data + data.size - current_position) <= header) {
+                return false;
+            }
+            if (decode_array_header() != sizeof...(I)) {
+                restore(cp);
+                return false;
+            }
+            enter();
+            bool ok = (try_read(std::get<I>(tuple)) && ...);
+            leave();
+            if (!ok) {
+                restore(cp);
+            }
+            return ok;
+        }
+
+    public:
+        explicit constexpr IStream(ConstView cv) : data(cv), current_position(data.data) { }
+
+        constexpr IStream(ConstView cv, Policy policy_) : Policy(std::move(policy_)), data(cv), current_position(data.data) { }
+
+        constexpr const Policy & policy() const {
+            return *this;
+        }
+
+        constexpr Policy & policy() {
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(Nil &) {
+            check_eof();
+            const char * start = current_position;
+            switch (*current_position) {
+                case '\xc0':
                     break;
                 default:
-                    throw TypeError("Expected binary", *current_position);
+                    fail<TypeError>("Expected nil", *current_position);
             }
             ++current_position;
-            check_eof(size);
-            s = std::vector<char>(current_position, current_position + size);
-            current_position += size;
+            record(start);
             return *this;
         }
 
-        template <typename... Args>
-        constexpr IStream& operator>>(std::tuple<Args&...> tuple) {
+        [[gnu::always_inline]] constexpr IStream& operator>>(bool & b) {
             check_eof();
-            size_t size = 0;
+            const char * start = current_position;
             switch (*current_position) {
-                case '\xdc':
-                    size = load_uint16();
+                case '\xc2':
+                    b = false;
                     break;
-                case '\xdd':
-                    size = load_uint32();
+                case '\xc3':
+                    b = true;
                     break;
                 default:
-                    if ((static_cast<unsigned char>(*current_position) & 0xF0u) == 0x90u) {
-                        size = static_cast<unsigned char>(*current_position) & 0x0Fu;
-                    } else {
-                        throw TypeError("Expected array", *current_position);
-                    }
+                    fail<TypeError>("Expected bool", *current_position);
             }
             ++current_position;
+            record(start);
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(long long & i) {
+            return decode_integer(i);
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(unsigned long long & i) {
+            return decode_integer(i);
+        }
+
+        // Where long is narrower than long long (LLP64), values that do not fit are rejected rather than truncated
+        [[gnu::always_inline]] constexpr IStream& operator>>(long & i) {
+            const char * start = current_position;
+            long long tmp = 0;
+            *this >> tmp;
+            if constexpr (sizeof(long) < sizeof(long long)) {
+                if (tmp < std::numeric_limits<long>::min() || tmp > std::numeric_limits<long>::max()) {
+                    current_position = start;
+                    fail<TypeError>("Integer out of range for long", *start);
+                }
+            }
+            i = static_cast<long>(tmp);
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(unsigned long & i) {
+            const char * start = current_position;
+            unsigned long long tmp = 0;
+            *this >> tmp;
+            if constexpr (sizeof(unsigned long) < sizeof(unsigned long long)) {
+                if (tmp > std::numeric_limits<unsigned long>::max()) {
+                    current_position = start;
+                    fail<TypeError>("Integer out of range for unsigned long", *start);
+                }
+            }
+            i = static_cast<unsigned long>(tmp);
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(int & i) {
+            return decode_integer(i);
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(unsigned int & i) {
+            return decode_integer(i);
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(short & i) {
+            return decode_integer(i);
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(unsigned short & i) {
+            return decode_integer(i);
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(signed char & i) {
+            return decode_integer(i);
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(unsigned char & i) {
+            return decode_integer(i);
+        }
+
+        // Also takes a float64 whose value float32 holds exactly, as canonical writers may produce either width
+        [[gnu::always_inline]] constexpr IStream& operator>>(float & i) {
+            check_eof();
+            const char * start = current_position;
+            if (*current_position == '\xca') {
+                FHelper bin_val{};
+                bin_val.u = load_uint32();
+                static_assert(sizeof(bin_val.u) == sizeof(i));
+                i = bin_val.f;
+            } else {
+                i = load_double_as_float();
+            }
+            ++current_position;
+            record(start);
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(double & i) {
+            check_eof();
+            const char * start = current_position;
+            if (*current_position == '\xcb') {
+                DHelper bin_val{};
+                bin_val.u = load_uint64();
+                static_assert(sizeof(bin_val.u) == sizeof(i));
+                i = bin_val.f;
+            } else {
+                i = load_float_as_double();
+            }
+            ++current_position;
+            record(start);
+            return *this;
+        }
+
+        IStream& operator>>(std::string & s) {
+            check_eof();
+            const char * start = current_position;
+            auto c = static_cast<unsigned char>(*current_position);
+            size_t size = (c & 0xE0u) == 0xA0u ? c & 0x1Fu : load_length(c, 0xd9, 0xdb, "Expected string");
+            ++current_position;
+            check_eof(size);
+            Policy::on_bytes(size);
+            if (size > std::string().capacity()) {
+                Policy::on_allocation(size);
+            }
+            s = std::string(current_position, size);
+            current_position += size;
+            record(start);
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr IStream& operator>>(std::string_view & s) {
+            check_eof();
+            const char * start = current_position;
+            auto c = static_cast<unsigned char>(*current_position);
+            size_t size = (c & 0xE0u) == 0xA0u ? c & 0x1Fu : load_length(c, 0xd9, 0xdb, "Expected string");
+            ++current_position;
+            check_eof(size);
+            s = std::string_view(current_position, size);
+            current_position += size;
+            record(start);
+            return *this;
+        }
+
+        IStream& operator>>(std::vector<char> & s) {
+            check_eof();
+            const char * start = current_position;
+            size_t size = load_length(static_cast<unsigned char>(*current_position), 0xc4, 0xc6, "Expected binary");
+            ++current_position;
+            check_eof(size);
+            Policy::on_bytes(size);
+            if (size != 0) {
+                Policy::on_allocation(size);
+            }
+            s = std::vector<char>(current_position, current_position + size);
+            current_position += size;
+            record(start);
+            return *this;
+        }
+
+        // Tuples decode out of line, with their fields inlined into the one call
+        template <typename... Args>
+        [[gnu::noinline]] constexpr IStream& operator>>(std::tuple<Args&...> tuple) {
+            size_t size = decode_array_header();
             if (size != sizeof...(Args)) {
-                throw LengthError("Bad array size", size, sizeof...(Args));
+                fail<LengthError>("Bad array size", size, sizeof...(Args));
             }
+            enter();
             tuple_stream_helper(tuple, std::index_sequence_for<Args...>{});
+            leave();
             return *this;
         }
 
         template <typename... Args>
-        constexpr IStream& operator>>(std::tuple<Args...> &tuple) {
+        [[gnu::noinline]] constexpr IStream& operator>>(std::tuple<Args...> &tuple) {
+            size_t size = decode_array_header();
+            if (size != sizeof...(Args)) {
+                fail<LengthError>("Bad array size", size, sizeof...(Args));
+            }
+            enter();
+            tuple_stream_helper(tuple, std::index_sequence_for<Args...>{});
+            leave();
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr size_t read_array_header() {
+            return decode_array_header();
+        }
+
+        [[gnu::always_inline]] constexpr size_t read_map_header() {
+            return decode_map_header();
+        }
+
+        // Takes rvalues too, so proxy types that refer to the destination can be read into directly
+        template <typename T, std::enable_if_t<has_msgpack_unpack<IStream, std::remove_reference_t<T>>::value, int> = 0>
+        constexpr IStream& operator>>(T && value) {
+            msgpack_unpack(*this, value);
+            return *this;
+        }
+
+        // Format byte of the next value, without consuming it
+        constexpr unsigned char peek() {
             check_eof();
+            return static_cast<unsigned char>(*current_position);
+        }
+
+        // Reads an extension value; the returned payload points into the input
+        constexpr std::string_view read_ext(signed char & type) {
+            check_eof();
+            const char * start = current_position;
+            auto c = static_cast<unsigned char>(*current_position);
             size_t size = 0;
-            switch (*current_position) {
-                case '\xdc':
-                    size = load_uint16();
-                    break;
-                case '\xdd':
-                    size = load_uint32();
-                    break;
-                default:
-                    if ((static_cast<unsigned char>(*current_position) & 0xF0u) == 0x90u) {
-                        size = static_cast<unsigned char>(*current_position) & 0x0Fu;
-                    } else {
-                        throw TypeError("Expected array", *current_position);
-                    }
+            if (c >= 0xd4 && c <= 0xd8) {
+                size = size_t(1) << (c - 0xd4u);
+            } else {
+                size = load_length(c, 0xc7, 0xc9, "Expected extension");
             }
             ++current_position;
-            if (size != sizeof...(Args)) {
-                throw LengthError("Bad array size", size, sizeof...(Args));
+            check_eof(size + 1);
+            type = static_cast<signed char>(*current_position++);
+            std::string_view payload(current_position, size);
+            current_position += size;
+            record(start);
+            return payload;
+        }
+
+        // Skips one complete value of any type, including nested arrays and maps
+        [[gnu::noinline]] constexpr IStream& skip() {
+            const char * start = current_position;
+            if (!try_skip()) {
+                fail<EOFError>("EOF", data.size - (start - data.data), 1);
+            }
+            return *this;
+        }
+
+        // Like skip(), but returns false and stays put if the value is cut off by the end of data.
+        // This is what tells a receive loop whether a whole message has arrived yet. Data that no amount
+        // of further bytes can complete, i.e. the never-used format byte 0xc1, still raises TypeError.
+        constexpr bool try_skip() {
+            const char * start = current_position;
+            size_t pending = 1;
+            if (!try_skip(pending)) {
+                current_position = start;
+                return false;
+            }
+            return true;
+        }
+
+        // Resumable form of try_skip(): skips pending values, counting the elements of arrays and maps
+        // it enters. When the data runs out it stops before the first incomplete value or header and
+        // returns false, with pending holding what is still missing, so a receive loop can carry on
+        // from there once more bytes arrive instead of rescanning the message. A 0xc1 byte raises TypeError,
+        // after which pending and the position are unspecified.
+        [[gnu::noinline]] constexpr bool try_skip(size_t & pending) {
+            auto available = [this](size_t n) {
+                return current_position - data.data + n <= data.size;
+            };
+            while (pending != 0) {
+                const char * start = current_position;
+                if (!available(1)) {
+                    return false;
+                }
+                --pending;
+                auto c = static_cast<unsigned char>(*current_position);
+                size_t header = 0;
+                switch (c) {
+                    case 0xc4: case 0xc7: case 0xd9:
+                        header = 1;
+                        break;
+                    case 0xc5: case 0xc8: case 0xda: case 0xdc: case 0xde:
+                        header = 2;
+                        break;
+                    case 0xc6: case 0xc9: case 0xdb: case 0xdd: case 0xdf:
+                        header = 4;
+                        break;
+                    default:
+                        break;
+                }
+                if (!available(1 + header)) {
+                    ++pending;
+                    return false;
+                }
+                size_t size = 0;
+                switch (c) {
+                    case 0xc0: case 0xc2: case 0xc3:
+                        break;
+                    case 0xcc: case 0xd0:
+                        size = 1;
+                        break;
+                    case 0xcd: case 0xd1:
+                        size = 2;
+                        break;
+                    case 0xca: case 0xce: case 0xd2:
+                        size = 4;
+                        break;
+                    case 0xcb: case 0xcf: case 0xd3:
+                        size = 8;
+                        break;
+                    case 0xc4: case 0xd9:
+                        size = load_uint8();
+                        break;
+                    case 0xc5: case 0xda:
+                        size = load_uint16();
+                        break;
+                    case 0xc6: case 0xdb:
+                        size = load_uint32();
+                        break;
+                    case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+                        size = 1 + (1u << (c - 0xd4u));
+                        break;
+                    case 0xc7:
+                        size = 1 + load_uint8();
+                        break;
+                    case 0xc8:
+                        size = 1 + load_uint16();
+                        break;
+                    case 0xc9:
+                        size = 1 + static_cast<size_t>(load_uint32());
+                        break;
+                    case 0xdc: case 0xdd:
+                        pending += load_array_header();
+                        continue;
+                    case 0xde: case 0xdf:
+                        pending += 2 * load_map_header();
+                        continue;
+                    case 0xc1:
+                        fail<TypeError>("Unknown type", *current_position);
+                    default:
+                        if ((c & 0xF0u) == 0x90u) {
+                            pending += load_array_header();
+                            continue;
+                        } else if ((c & 0xF0u) == 0x80u) {
+                            pending += 2 * load_map_header();
+                            continue;
+                        } else if ((c & 0xE0u) == 0xA0u) {
+                            size = c & 0x1Fu;
+                        }
+                }
+                ++current_position;
+                if (!available(size)) {
+                    current_position = start;
+                    ++pending;
+                    return false;
+                }
+                current_position += size;
+            }
+            return true;
+        }
+
+        // Number of bytes consumed so far
+        constexpr size_t tell() const {
+            return current_position - data.data;
+        }
+
+        // Saved read position and nesting depth. restore() leaves the containers entered since, so depth
+        // limits hold after a failed read; counters such as Stats totals are not rolled back.
+        class Checkpoint {
+            friend class IStream;
+
+            const char * position;
+            size_t depth;
+
+            constexpr Checkpoint(const char * position_, size_t depth_) : position(position_), depth(depth_) { }
+        };
+
+        constexpr Checkpoint checkpoint() const {
+            return Checkpoint(current_position, nesting());
+        }
+
+        constexpr void restore(Checkpoint cp) {
+            current_position = cp.position;
+            while (nesting() > cp.depth) {
+                leave();
+            }
+        }
+
+        // Reads the next value into value if it has a matching type and is complete; otherwise returns false
+        // and leaves the stream where it was. Tuples are probed element by element, all or nothing.
+        // User types with a msgpack_unpack hook are probed by catching decode errors.
+        template <typename T>
+        [[gnu::noinline]] constexpr bool try_read(T & value) {
+            if constexpr (has_msgpack_unpack<IStream, T>::value) {
+                return try_unpack(value);
+            } else {
+                if (current_position == data.data + data.size || !accepts<T>(static_cast<unsigned char>(*current_position))) {
+                    return false;
+                }
+                const char * start = current_position;
+                if (!try_skip()) {
+                    return false;
+                }
+                current_position = start;
+                if constexpr (std::is_same_v<T, float>) {
+                    // A float64 is only taken when float32 holds it exactly
+                    if (*start == '\xcb') {
+                        double wide = 0;
+                        *this >> wide;
+                        auto narrow = static_cast<float>(wide);
+                        if (wide == wide && static_cast<double>(narrow) != wide) {
+                            current_position = start;
+                            return false;
+                        }
+                        value = narrow;
+                        return true;
+                    }
+                }
+                *this >> value;
+                return true;
+            }
+        }
+
+        template <typename... Args>
+        constexpr bool try_read(std::tuple<Args...> & tuple) {
+            return try_read_tuple(tuple, std::index_sequence_for<Args...>{});
+        }
+
+        template <typename... Args>
+        constexpr bool try_read(std::tuple<Args&...> tuple) {
+            return try_read_tuple(tuple, std::index_sequence_for<Args...>{});
+        }
+
+        template <typename T>
+        constexpr std::optional<T> try_read() {
+            T value{};
+            if (try_read(value)) {
+                return value;
+            }
+            return std::nullopt;
+        }
+
+        // Decodes a map with string keys into the fields named by keys; unknown keys are skipped
+        template <size_t N, typename... Args>
+        [[gnu::noinline]] constexpr IStream& read_struct(const KeySet<N> &keys, std::tuple<Args&...> fields) {
+            static_assert(N == sizeof...(Args));
+            size_t size = decode_map_header();
+            enter();
+            for (size_t i = 0; i != size; ++i) {
+                std::string_view key;
+                *this >> key;
+                size_t field = keys.find(key);
+                if (field == N) {
+                    skip();
+                } else {
+                    struct_field_helper(fields, field, std::index_sequence_for<Args...>{});
+                }
+            }
+            leave();
+            return *this;
+        }
+
+        InternedKey read_key(KeyInterner &interner) {
+            std::string_view key;
+            *this >> key;
+            return interner.intern(key);
+        }
+
+        // Decodes an array of same-shaped rows straight into one column per field.
+        // Each row header is checked against sizeof...(Args); values are appended to the columns.
+        // If a row fails to decode, its partial values are removed so the columns keep equal lengths.
+        template <typename... Args>
+        IStream& read_columns(std::vector<Args> &... columns) {
+            size_t rows = decode_array_header();
+            // Every row takes at least one byte, so hostile row counts fail before reserving
+            check_eof(rows);
+            (Policy::on_allocation(rows * sizeof(Args)), ...);
+            (columns.reserve(columns.size() + rows), ...);
+            const std::array<size_t, sizeof...(Args)> sizes{columns.size()...};
+            enter();
+            size_t row = 0;
+            try {
+                for (; row != rows; ++row) {
+                    size_t size = decode_array_header();
+                    if (size != sizeof...(Args)) {
+                        fail<LengthError>("Bad row size", size, sizeof...(Args));
+                    }
+                    enter();
+                    (column_push(columns), ...);
+                    leave();
+                }
+            } catch (...) {
+                size_t i = 0;
+                (columns.erase(columns.begin() + static_cast<std::ptrdiff_t>(sizes[i++] + row), columns.end()), ...);
+                throw;
+            }
+            leave();
+            return *this;
+        }
+
+        template <typename... Args>
+        IStream& read_columns(std::tuple<std::vector<Args>...> &columns) {
+            return std::apply([this](auto &... column) -> IStream& {
+                return read_columns(column...);
+            }, columns);
+        }
+    };
+
+    enum class Encoding {
+        Compact,
+        // Equal values always produce equal bytes: minimal widths, sorted struct keys, normalized floats
+        Canonical,
+    };
+
+    // Forwards bytes to another sink while computing their XXH64 digest on the fly
+    template <class MV>
+    class HashSink {
+        static constexpr unsigned long long P1 = 11400714785074694791ull;
+        static constexpr unsigned long long P2 = 14029467366897019727ull;
+        static constexpr unsigned long long P3 = 1609587929392839161ull;
+        static constexpr unsigned long long P4 = 9650029242287828579ull;
+        static constexpr unsigned long long P5 = 2870177450012600261ull;
+
+        MV &out;
+        unsigned long long seed;
+        unsigned long long acc[4];
+        unsigned char stripe[32]{};
+        size_t buffered = 0;
+        unsigned long long stripes = 0;
+
+        static constexpr unsigned long long rotl(unsigned long long x, unsigned r) {
+            return (x << r) | (x >> (64u - r));
+        }
+
+        static constexpr unsigned long long round(unsigned long long a, unsigned long long input) {
+            a += input * P2;
+            a = rotl(a, 31);
+            return a * P1;
+        }
+
+        static constexpr unsigned long long merge_round(unsigned long long h, unsigned long long a) {
+            h ^= round(0, a);
+            return h * P1 + P4;
+        }
+
+        constexpr unsigned long long read_le(size_t pos, size_t n) const {
+            unsigned long long v = 0;
+            for (size_t i = n; i != 0; --i) {
+                v = (v << 8u) | stripe[pos + i - 1];
+            }
+            return v;
+        }
+
+        // Once per 32 bytes, so kept out of the push_back inlined into every write
+        [[gnu::noinline]] constexpr void consume_stripe() {
+            for (size_t i = 0; i != 4; ++i) {
+                acc[i] = round(acc[i], read_le(8 * i, 8));
+            }
+            buffered = 0;
+            ++stripes;
+        }
+
+    public:
+        explicit constexpr HashSink(MV &out_, unsigned long long seed_ = 0)
+            : out(out_), seed(seed_), acc{seed_ + P1 + P2, seed_ + P2, seed_, seed_ - P1} { }
+
+        constexpr void push_back(char c) {
+            out.push_back(c);
+            stripe[buffered++] = static_cast<unsigned char>(c);
+            if (buffered == 32) {
+                consume_stripe();
+            }
+        }
+
+        constexpr unsigned long long digest() const {
+            unsigned long long h = 0;
+            if (stripes != 0) {
+                h = rotl(acc[0], 1) + rotl(acc[1], 7) + rotl(acc[2], 12) + rotl(acc[3], 18);
+                for (auto a : acc) {
+                    h = merge_round(h, a);
+                }
+            } else {
+                h = seed + P5;
+            }
+            h += 32 * stripes + buffered;
+            size_t pos = 0;
+            for (; pos + 8 <= buffered; pos += 8) {
+                h ^= round(0, read_le(pos, 8));
+                h = rotl(h, 27) * P1 + P4;
+            }
+            if (pos + 4 <= buffered) {
+                h ^= read_le(pos, 4) * P1;
+                h = rotl(h, 23) * P2 + P3;
+                pos += 4;
+            }
+            for (; pos != buffered; ++pos) {
+                h ^= stripe[pos] * P5;
+                h = rotl(h, 11) * P1;
             }
-            tuple_stream_helper(tuple, std::index_sequence_for<Args...>{});
-            return *this;
+            h ^= h >> 33u;
+            h *= P2;
+            h ^= h >> 29u;
+            h *= P3;
+            h ^= h >> 32u;
+            return h;
+        }
+
+        constexpr MV & sink() {
+            return out;
         }
     };
 
-    template <class MV>
-    class OStream {
+    template <class MV, Encoding E = Encoding::Compact, class Policy = NoStats>
+    class OStream : private Policy {
         MV &data;
 
-        constexpr void push_uint8(unsigned char i) {
-            data.push_back(i);
+        [[gnu::always_inline]] constexpr void put(char c) {
+            data.push_back(c);
+            Policy::on_byte(c);
+        }
+
+        [[gnu::always_inline]] constexpr void push_uint8(unsigned char i) {
+            put(i);
+        }
+
+        // Big-endian field after the format byte, as a loop for the same reason as IStream::load_big_endian
+        template <typename T>
+        [[gnu::always_inline]] constexpr void push_big_endian(T i) {
+            for (size_t k = sizeof(T); k != 0; --k) {
+                put(static_cast<unsigned char>(i >> (8u * (k - 1))));
+            }
         }
 
-        constexpr void push_uint16(unsigned short i) {
-            data.push_back(static_cast<unsigned char>((i >> 8u) & ((1u << 8u) - 1u)));
-            data.push_back(static_cast<unsigned char>(i & ((1u << 8u) - 1u)));
+        [[gnu::always_inline]] constexpr void push_uint16(unsigned short i) {
+            push_big_endian(i);
         }
 
-        constexpr void push_uint32(unsigned int i) {
-            data.push_back(static_cast<unsigned char>((i >> 24u) & ((1u << 8u) - 1u)));
-            data.push_back(static_cast<unsigned char>((i >> 16u) & ((1u << 8u) - 1u)));
-            data.push_back(static_cast<unsigned char>((i >> 8u) & ((1u << 8u) - 1u)));
-            data.push_back(static_cast<unsigned char>(i & ((1u << 8u) - 1u)));
+        [[gnu::always_inline]] constexpr void push_uint32(unsigned int i) {
+            push_big_endian(i);
         }
 
-        constexpr void push_uint64(unsigned long long i) {
-            data.push_back(static_cast<unsigned char>((i >> 56u) & ((1ull << 8u) - 1ull)));
-            data.push_back(static_cast<unsigned char>((i >> 48u) & ((1ull << 8u) - 1ull)));
-            data.push_back(static_cast<unsigned char>((i >> 40u) & ((1ull << 8u) - 1ull)));
-            data.push_back(static_cast<unsigned char>((i >> 32u) & ((1ull << 8u) - 1ull)));
-            data.push_back(static_cast<unsigned char>((i >> 24u) & ((1ull << 8u) - 1ull)));
-            data.push_back(static_cast<unsigned char>((i >> 16u) & ((1ull << 8u) - 1ull)));
-            data.push_back(static_cast<unsigned char>((i >> 8u) & ((1ull << 8u) - 1ull)));
-            data.push_back(static_cast<unsigned char>(i & ((1u << 8u) - 1u)));
+        [[gnu::always_inline]] constexpr void push_uint64(unsigned long long i) {
+            push_big_endian(i);
         }
 
         template <typename... Args, std::size_t... Idx>
@@ -612,242 +1534,853 @@ namespace msgpackcpp {
             return (*this << ... << std::get<Idx>(tuple));
         }
 
-    public:
-        explicit constexpr OStream(MV &data_) : data(data_) {}
+        template <size_t N, typename... Args, std::size_t... Idx>
+        constexpr void struct_stream_helper(const KeySet<N> &keys, const std::tuple<Args...> &fields, std::index_sequence<Idx...>) {
+            if constexpr (E == Encoding::Canonical) {
+                for (size_t i = 0; i != N; ++i) {
+                    size_t field = keys.sorted(i);
+                    *this << keys[field];
+                    ((field == Idx ? (void)(*this << std::get<Idx>(fields)) : void()), ...);
+                }
+            } else {
+                ((*this << keys[Idx] << std::get<Idx>(fields)), ...);
+            }
+        }
 
-        constexpr OStream& operator<<(Nil) {
-            data.push_back('\xc0');
+        // Fixints encode inline; the wider formats go through push_wide_int / push_wide_uint, kept out of line
+        // so every inlined integer write stays small. Compact encoding picks the width by magnitude, so
+        // 16..127 take an int8 rather than a positive fixint.
+        [[gnu::always_inline]] constexpr OStream& push_signed(long long i) {
+            Policy::on_begin_value();
+            if (i >= -16 && i < 16) {
+                put(static_cast<unsigned char>(static_cast<char>(i)));
+            } else {
+                push_wide_int(i);
+            }
+            Policy::on_end_value();
             return *this;
         }
 
-        constexpr OStream& operator<<(bool b) {
-            data.push_back(b ? '\xc3' : '\xc2');
+        [[gnu::always_inline]] constexpr OStream& push_unsigned(unsigned long long i) {
+            Policy::on_begin_value();
+            if (i < 1u << 7u) {
+                put(static_cast<unsigned char>(i));
+            } else {
+                push_wide_uint(i);
+            }
+            Policy::on_end_value();
             return *this;
         }
 
-        constexpr OStream& operator<<(long long i) {
-            unsigned long long ui = 0;
-            if (i >= 0) {
-                ui = i;
+        [[gnu::noinline]] constexpr void push_wide_int(long long i) {
+            if (i >= -(1 << 7) && i < 1 << 7) {
+                push_uint8(0xd0);
+                push_uint8(static_cast<unsigned char>(i));
+            } else if (i >= -(1 << 15) && i < 1 << 15) {
+                push_uint8(0xd1);
+                push_uint16(static_cast<unsigned short>(i));
+            } else if (i >= -(1ll << 31) && i < 1ll << 31) {
+                push_uint8(0xd2);
+                push_uint32(static_cast<unsigned int>(i));
             } else {
-                ui = 0ull - i - 1u;
-            }
-            if (ui >= 1ull << 31u) {
-                data.push_back('\xd3');
+                push_uint8(0xd3);
                 push_uint64(static_cast<unsigned long long>(i));
-            } else if (ui >= 1u << 15u) {
-                data.push_back('\xd2');
-                push_uint32(static_cast<unsigned int>(static_cast<int>(i)));
-            } else if (ui >= 1u << 7u) {
-                data.push_back('\xd1');
-                push_uint16(static_cast<unsigned short>(static_cast<short>(i)));
-            } else if (ui >= 1u << 4u) {
-                data.push_back('\xd0');
-                push_uint8(static_cast<unsigned char>(static_cast<char>(i)));
-            } else {
-                auto uis = static_cast<unsigned char>(static_cast<char>(i));
-                data.push_back(uis);
             }
-            return *this;
         }
 
-        constexpr OStream& operator<<(unsigned long long i) {
-            if (i >= 1ull << 32u) {
-                data.push_back('\xcf');
-                push_uint64(i);
-            } else if (i >= 1u << 16u) {
-                data.push_back('\xce');
-                push_uint32(i);
-            } else if (i >= 1u << 8u) {
-                data.push_back('\xcd');
-                push_uint16(i);
-            } else if (i >= 1u << 7u) {
-                data.push_back('\xcc');
-                push_uint8(i);
+        [[gnu::noinline]] constexpr void push_wide_uint(unsigned long long i) {
+            if (i < 1u << 8u) {
+                push_uint8(0xcc);
+                push_uint8(static_cast<unsigned char>(i));
+            } else if (i < 1u << 16u) {
+                push_uint8(0xcd);
+                push_uint16(static_cast<unsigned short>(i));
+            } else if (i < 1ull << 32u) {
+                push_uint8(0xce);
+                push_uint32(static_cast<unsigned int>(i));
             } else {
-                data.push_back(static_cast<unsigned char>(i));
+                push_uint8(0xcf);
+                push_uint64(i);
             }
-            return *this;
         }
 
-        constexpr OStream& operator<<(int i) {
-            unsigned int ui = 0;
+        // Canonical integers take the smallest format, whatever the source type
+        [[gnu::always_inline]] constexpr OStream& push_canonical(long long i) {
             if (i >= 0) {
-                ui = i;
-            } else {
-                ui = 0u - i - 1u;
-            }
-            if (ui >= 1u << 15u) {
-                data.push_back('\xd2');
-                push_uint32(static_cast<unsigned int>(static_cast<int>(i)));
-            } else if (ui >= 1u << 7u) {
-                data.push_back('\xd1');
-                push_uint16(static_cast<unsigned short>(static_cast<short>(i)));
-            } else if (ui >= 1u << 4u) {
-                data.push_back('\xd0');
-                push_uint8(static_cast<unsigned char>(static_cast<char>(i)));
+                return push_unsigned(static_cast<unsigned long long>(i));
+            }
+            Policy::on_begin_value();
+            if (i >= -32) {
+                put(static_cast<unsigned char>(static_cast<char>(i)));
             } else {
-                auto uis = static_cast<unsigned char>(static_cast<char>(i));
-                data.push_back(uis);
+                push_wide_int(i);
             }
+            Policy::on_end_value();
             return *this;
         }
 
-        constexpr OStream& operator<<(unsigned int i) {
-            if (i >= 1u << 16u) {
-                data.push_back('\xce');
-                push_uint32(i);
-            } else if (i >= 1u << 8u) {
-                data.push_back('\xcd');
-                push_uint16(i);
-            } else if (i >= 1u << 7u) {
-                data.push_back('\xcc');
-                push_uint8(i);
-            } else {
-                data.push_back(static_cast<unsigned char>(i));
+        // NaN collapses to one quiet NaN, -0.0 to 0.0, and values exact in float32 use float32
+        [[gnu::noinline]] constexpr OStream& push_canonical_float(double i) {
+            Policy::on_begin_value();
+            if (i != i) {
+                put('\xca');
+                push_uint32(0x7FC00000u);
+                Policy::on_end_value();
+                return *this;
+            }
+            if (i == 0) {
+                i = 0.0;
+            }
+            if (i == i + i || (i <= std::numeric_limits<float>::max() && i >= -std::numeric_limits<float>::max())) {
+                auto f = static_cast<float>(i);
+                if (static_cast<double>(f) == i) {
+                    put('\xca');
+                    FHelper bin_val{};
+                    bin_val.f = f;
+                    push_uint32(bin_val.u);
+                    Policy::on_end_value();
+                    return *this;
+                }
             }
+            put('\xcb');
+            DHelper bin_val{};
+            bin_val.f = i;
+            push_uint64(bin_val.u);
+            Policy::on_end_value();
             return *this;
         }
 
-        constexpr OStream& operator<<(short i) {
-            unsigned short ui = 0;
-            if (i >= 0) {
-                ui = i;
-            } else {
-                ui = 0u - i - 1u;
-            }
-            if (ui >= 1u << 7u) {
-                data.push_back('\xd1');
-                push_uint16(static_cast<unsigned short>(static_cast<short>(i)));
-            } else if (ui >= 1u << 4u) {
-                data.push_back('\xd0');
-                push_uint8(static_cast<unsigned char>(static_cast<char>(i)));
+        // Smallest sized header for size: format byte last takes a 32-bit length and each one before it half
+        // that, down to first. Kept out of line, as the fixed-size forms are the common case.
+        [[gnu::noinline]] constexpr void push_length(size_t size, unsigned char first, unsigned char last) {
+            if (size >= 1u << 16u) {
+                push_uint8(last);
+                push_uint32(static_cast<unsigned int>(size));
+            } else if (size >= 1u << 8u || last - first == 1) {
+                push_uint8(static_cast<unsigned char>(last - 1));
+                push_uint16(static_cast<unsigned short>(size));
             } else {
-                auto uis = static_cast<unsigned char>(static_cast<char>(i));
-                data.push_back(uis);
+                push_uint8(first);
+                push_uint8(static_cast<unsigned char>(size));
+            }
+        }
+
+        // Payload of a str, bin or ext value, a byte at a time as MV only has push_back
+        constexpr void push_bytes(const char * bytes, size_t size) {
+            for (size_t i = 0; i != size; ++i) {
+                put(bytes[i]);
             }
-            return *this;
         }
 
-        constexpr OStream& operator<<(unsigned short i) {
-            if (i >= 1u << 8u) {
-                data.push_back('\xcd');
-                push_uint16(i);
-            } else if (i >= 1u << 7u) {
-                data.push_back('\xcc');
-                push_uint8(i);
+        [[gnu::always_inline]] constexpr void push_str_header(size_t size) {
+            if (size < 32) {
+                put(static_cast<unsigned char>(0xA0u | size));
             } else {
-                data.push_back(static_cast<unsigned char>(i));
+                push_length(size, 0xd9, 0xdb);
             }
+        }
+
+    public:
+        explicit constexpr OStream(MV &data_) : data(data_) {}
+
+        constexpr OStream(MV &data_, Policy policy_) : Policy(std::move(policy_)), data(data_) {}
+
+        constexpr const Policy & policy() const {
             return *this;
         }
 
-        constexpr OStream& operator<<(char i) {
-            unsigned char ui = 0;
-            if (i >= 0) {
-                ui = i;
-            } else {
-                ui = 0u - i - 1u;
+        constexpr Policy & policy() {
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(Nil) {
+            Policy::on_begin_value();
+            put('\xc0');
+            Policy::on_end_value();
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(bool b) {
+            Policy::on_begin_value();
+            put(b ? '\xc3' : '\xc2');
+            Policy::on_end_value();
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(long long i) {
+            if constexpr (E == Encoding::Canonical) {
+                return push_canonical(i);
             }
-            if (ui >= 1u << 4u) {
-                data.push_back('\xd0');
-                push_uint8(static_cast<unsigned char>(static_cast<char>(i)));
-            } else {
-                auto uis = static_cast<unsigned char>(static_cast<char>(i));
-                data.push_back(uis);
+            return push_signed(i);
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(unsigned long long i) {
+            return push_unsigned(i);
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(long i) {
+            return *this << static_cast<long long>(i);
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(unsigned long i) {
+            return *this << static_cast<unsigned long long>(i);
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(int i) {
+            if constexpr (E == Encoding::Canonical) {
+                return push_canonical(i);
             }
-            return *this;
+            return push_signed(i);
         }
 
-        constexpr OStream& operator<<(unsigned char i) {
-            if (i >= 1u << 7u) {
-                data.push_back('\xcc');
-                push_uint8(i);
-            } else {
-                data.push_back(static_cast<unsigned char>(i));
+        [[gnu::always_inline]] constexpr OStream& operator<<(unsigned int i) {
+            return push_unsigned(i);
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(short i) {
+            if constexpr (E == Encoding::Canonical) {
+                return push_canonical(i);
             }
-            return *this;
+            return push_signed(i);
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(unsigned short i) {
+            return push_unsigned(i);
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(char i) {
+            if constexpr (E == Encoding::Canonical) {
+                return push_canonical(i);
+            }
+            return push_signed(i);
         }
 
-        constexpr OStream& operator<<(float i) {
-            data.push_back('\xca');
+        [[gnu::always_inline]] constexpr OStream& operator<<(unsigned char i) {
+            return push_unsigned(i);
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(float i) {
+            if constexpr (E == Encoding::Canonical) {
+                return push_canonical_float(i);
+            }
+            Policy::on_begin_value();
+            put('\xca');
             FHelper f{};
             f.f = i;
             static_assert(sizeof(f.u) == sizeof(i));
             push_uint32(f.u);
+            Policy::on_end_value();
             return *this;
         }
 
-        constexpr OStream& operator<<(double i) {
-            data.push_back('\xcb');
+        [[gnu::always_inline]] constexpr OStream& operator<<(double i) {
+            if constexpr (E == Encoding::Canonical) {
+                return push_canonical_float(i);
+            }
+            Policy::on_begin_value();
+            put('\xcb');
             DHelper f{};
             f.f = i;
             static_assert(sizeof(f.u) == sizeof(i));
             push_uint64(f.u);
+            Policy::on_end_value();
             return *this;
         }
 
-        OStream& operator<<(const std::string & s) {
-            if ((s.size() >> 8u) == 0) {
-                data.push_back('\xd9');
-                *this << static_cast<unsigned char>(s.size());
-            } else if ((s.size() >> 16u) == 0) {
-                data.push_back('\xda');
-                *this << static_cast<unsigned short>(s.size());
+        [[gnu::always_inline]] OStream& operator<<(const std::string & s) {
+            return *this << std::string_view(s);
+        }
+
+        // Values with a payload are written out of line, as copying the payload already costs more than a call
+        [[gnu::noinline]] constexpr OStream& operator<<(std::string_view s) {
+            Policy::on_begin_value();
+            push_str_header(s.size());
+            push_bytes(s.data(), s.size());
+            Policy::on_end_value();
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr OStream& operator<<(const char * s) {
+            return *this << std::string_view(s);
+        }
+
+        [[gnu::noinline]] OStream& operator<<(const std::vector<char> & s) {
+            Policy::on_begin_value();
+            push_length(s.size(), 0xc4, 0xc6);
+            push_bytes(s.data(), s.size());
+            Policy::on_end_value();
+            return *this;
+        }
+
+        // Extension value; payloads of 1, 2, 4, 8 and 16 bytes use the fixext formats
+        [[gnu::noinline]] constexpr OStream& write_ext(signed char type, std::string_view payload) {
+            Policy::on_begin_value();
+            size_t size = payload.size();
+            if (size == 1 || size == 2 || size == 4 || size == 8 || size == 16) {
+                unsigned char format = 0xd4;
+                while ((1u << (format - 0xd4u)) != size) {
+                    ++format;
+                }
+                put(format);
             } else {
-                data.push_back('\xdb');
-                *this << static_cast<unsigned int>(s.size());
-            }
-            for (char c : s) {
-                data.push_back(c);
+                push_length(size, 0xc7, 0xc9);
             }
+            put(type);
+            push_bytes(payload.data(), payload.size());
+            Policy::on_end_value();
             return *this;
         }
 
-        OStream& operator<<(const std::vector<char> & s) {
-            if ((s.size() >> 8u) == 0) {
-                data.push_back('\xc4');
-                *this << static_cast<unsigned char>(s.size());
-            } else if ((s.size() >> 16u) == 0) {
-                data.push_back('\xc5');
-                *this << static_cast<unsigned short>(s.size());
+        [[gnu::always_inline]] constexpr OStream& write_array_header(size_t size) {
+            Policy::on_begin_value();
+            if (size < 16) {
+                put(static_cast<unsigned char>(0x90u | size));
             } else {
-                data.push_back('\xc6');
-                *this << static_cast<unsigned int>(s.size());
+                push_length(size, 0xdc, 0xdd);
             }
-            for (char c : s) {
-                data.push_back(c);
+            Policy::on_end_value();
+            return *this;
+        }
+
+        [[gnu::always_inline]] constexpr OStream& write_map_header(size_t size) {
+            Policy::on_begin_value();
+            if (size < 16) {
+                put(static_cast<unsigned char>(0x80u | size));
+            } else {
+                push_length(size, 0xde, 0xdf);
             }
+            Policy::on_end_value();
             return *this;
         }
 
+        // Encodes fields as a map keyed by the names in keys
+        template <size_t N, typename... Args>
+        [[gnu::noinline]] constexpr OStream& write_struct(const KeySet<N> &keys, const std::tuple<Args...> &fields) {
+            static_assert(N == sizeof...(Args));
+            write_map_header(N);
+            Policy::on_enter();
+            struct_stream_helper(keys, fields, std::index_sequence_for<Args...>{});
+            Policy::on_leave();
+            return *this;
+        }
+
+        // Tuples encode out of line, with their fields inlined into the one call
         template <typename... Args>
-        constexpr OStream& operator<<(std::tuple<const Args&...> tuple) {
-            if (sizeof...(Args) < (1u << 16u)) {
-                data.push_back('\xdc');
+        [[gnu::noinline]] constexpr OStream& operator<<(std::tuple<const Args&...> tuple) {
+            Policy::on_begin_value();
+            if constexpr (E == Encoding::Canonical) {
+                write_array_header(sizeof...(Args));
+            } else if (sizeof...(Args) < (1u << 16u)) {
+                put('\xdc');
                 push_uint16(static_cast<unsigned short>(sizeof...(Args)));
             } else {
-                data.push_back('\xdd');
+                put('\xdd');
                 push_uint32(static_cast<unsigned int>(sizeof...(Args)));
             }
+            Policy::on_end_value();
+            Policy::on_enter();
             tuple_stream_helper(tuple, std::index_sequence_for<Args...>{});
+            Policy::on_leave();
             return *this;
         }
 
         template <typename... Args>
-        constexpr OStream& operator<<(const std::tuple<Args...> &tuple) {
-            if (sizeof...(Args) < (1u << 16u)) {
-                data.push_back('\xdc');
+        [[gnu::noinline]] constexpr OStream& operator<<(const std::tuple<Args...> &tuple) {
+            Policy::on_begin_value();
+            if constexpr (E == Encoding::Canonical) {
+                write_array_header(sizeof...(Args));
+            } else if (sizeof...(Args) < (1u << 16u)) {
+                put('\xdc');
                 push_uint16(static_cast<unsigned short>(sizeof...(Args)));
             } else {
-                data.push_back('\xdd');
+                put('\xdd');
                 push_uint32(static_cast<unsigned int>(sizeof...(Args)));
             }
+            Policy::on_end_value();
+            Policy::on_enter();
             tuple_stream_helper(tuple, std::index_sequence_for<Args...>{});
+            Policy::on_leave();
+            return *this;
+        }
+
+        template <typename T, std::enable_if_t<has_msgpack_pack<OStream, T>::value, int> = 0>
+        constexpr OStream& operator<<(const T & value) {
+            msgpack_pack(*this, value);
+            return *this;
+        }
+    };
+
+    class BufferPool;
+
+    // Encode buffer on loan from a BufferPool; it goes back to the pool when destroyed.
+    // A buffer may be moved to and destroyed on any thread and may outlive its pool: only when it is
+    // destroyed on the pool's own thread while that pool is alive does it return, otherwise it is freed.
+    class PooledBuffer {
+        BufferPool * pool;
+        std::thread::id owner;
+        // Set when the pool is destroyed; shared, so it outlives the pool. The thread id alone is not
+        // enough, since ids are reused once a thread exits.
+        std::shared_ptr<const std::atomic<bool>> retired;
+        std::vector<char> buf;
+
+    public:
+        PooledBuffer(BufferPool * pool_, std::thread::id owner_, std::shared_ptr<const std::atomic<bool>> retired_,
+                     std::vector<char> && buf_)
+            : pool(pool_), owner(owner_), retired(std::move(retired_)), buf(std::move(buf_)) { }
+
+        PooledBuffer(PooledBuffer && other) noexcept
+            : pool(std::exchange(other.pool, nullptr)), owner(other.owner), retired(std::move(other.retired)),
+              buf(std::move(other.buf)) { }
+
+        PooledBuffer & operator=(PooledBuffer &&) = delete;
+
+        ~PooledBuffer();
+
+        std::vector<char> & vector() {
+            return buf;
+        }
+
+        const char * data() const {
+            return buf.data();
+        }
+
+        size_t size() const {
+            return buf.size();
+        }
+
+        template <Encoding E = Encoding::Compact>
+        OStream<std::vector<char>, E> stream() {
+            return OStream<std::vector<char>, E>(buf);
+        }
+
+        // Empties the buffer but keeps the loan, so it can encode the next message
+        void reset() {
+            buf.clear();
+        }
+
+        // Takes the vector out of the pool's reach, e.g. to hand it to another owner
+        std::vector<char> detach() {
+            pool = nullptr;
+            return std::move(buf);
+        }
+    };
+
+    // Free lists of encode buffers bucketed by capacity in powers of two.
+    // Cached capacity never exceeds the high-water mark; the largest buffers are dropped first.
+    // A pool belongs to the thread that created it; buffers still on loan when it is destroyed are freed.
+    class BufferPool {
+        static constexpr size_t min_capacity = 256;
+        static constexpr size_t classes = 16;
+
+        std::array<std::vector<std::vector<char>>, classes> free;
+        size_t high_water;
+        size_t cached = 0;
+        std::thread::id owner = std::this_thread::get_id();
+        std::shared_ptr<std::atomic<bool>> retired = std::make_shared<std::atomic<bool>>(false);
+
+        static size_t class_of(size_t capacity) {
+            size_t c = 0;
+            while (c + 1 != classes && (min_capacity << (c + 1)) <= capacity) {
+                ++c;
+            }
+            return c;
+        }
+
+        void drop_largest() {
+            for (size_t c = classes; c-- != 0;) {
+                if (!free[c].empty()) {
+                    cached -= free[c].back().capacity();
+                    free[c].pop_back();
+                    return;
+                }
+            }
+        }
+
+    public:
+        explicit BufferPool(size_t high_water_ = 16u << 20u) : high_water(high_water_) { }
+
+        BufferPool(const BufferPool &) = delete;
+        BufferPool & operator=(const BufferPool &) = delete;
+
+        ~BufferPool() {
+            retired->store(true, std::memory_order_release);
+        }
+
+        // Pool of the calling thread
+        static BufferPool & local() {
+            static thread_local BufferPool pool;
+            return pool;
+        }
+
+        // Smallest cached buffer that holds at least hint bytes, or a new one
+        PooledBuffer acquire(size_t hint = 0) {
+            size_t want = std::max(hint, min_capacity);
+            size_t c = class_of(want);
+            if ((min_capacity << c) < want && c + 1 != classes) {
+                ++c;
+            }
+            for (; c != classes; ++c) {
+                auto & list = free[c];
+                if (!list.empty() && list.back().capacity() >= want) {
+                    std::vector<char> buf = std::move(list.back());
+                    list.pop_back();
+                    cached -= buf.capacity();
+                    return PooledBuffer(this, owner, retired, std::move(buf));
+                }
+            }
+            std::vector<char> buf;
+            buf.reserve(std::max(want, min_capacity << class_of(want)));
+            return PooledBuffer(this, owner, retired, std::move(buf));
+        }
+
+        void release(std::vector<char> && buf) {
+            size_t capacity = buf.capacity();
+            if (capacity < min_capacity || capacity > high_water) {
+                return;
+            }
+            while (cached + capacity > high_water) {
+                drop_largest();
+            }
+            buf.clear();
+            cached += capacity;
+            free[class_of(capacity)].push_back(std::move(buf));
+        }
+
+        // Frees cached buffers until at most target bytes stay cached
+        void shrink(size_t target = 0) {
+            while (cached > target) {
+                drop_largest();
+            }
+        }
+
+        void set_high_water(size_t bytes) {
+            high_water = bytes;
+            shrink(high_water);
+        }
+
+        size_t cached_bytes() const {
+            return cached;
+        }
+
+        size_t cached_buffers() const {
+            size_t n = 0;
+            for (auto & list : free) {
+                n += list.size();
+            }
+            return n;
+        }
+    };
+
+    // Out of line: besides every scope exit, it runs on each unwinding path a loan is live on
+    [[gnu::noinline]] inline PooledBuffer::~PooledBuffer() {
+        if (pool != nullptr && owner == std::this_thread::get_id() && !retired->load(std::memory_order_acquire)) {
+            pool->release(std::move(buf));
+        }
+    }
+
+    // Where one message of a batch sits in the batch buffer, not counting its length prefix
+    struct BatchEntry {
+        size_t offset;
+        size_t length;
+    };
+
+    enum class Framing {
+        None,
+        // Each message is preceded by its length as 4 bytes big-endian
+        LengthPrefixed,
+    };
+
+    // Encodes independent messages back to back into one buffer and keeps an offset table, so the
+    // batch can go out in one write and still be sliced per message without re-scanning
+    template <Encoding E = Encoding::Compact>
+    class BatchWriter {
+        std::vector<char> & out;
+        Framing framing;
+        size_t base;
+        std::vector<BatchEntry> table;
+
+        template <class F>
+        void append(F && write) {
+            size_t start = out.size();
+            if (framing == Framing::LengthPrefixed) {
+                out.insert(out.end(), 4, '\0');
+            }
+            size_t body = out.size();
+            try {
+                OStream<std::vector<char>, E> os(out);
+                write(os);
+            } catch (...) {
+                out.resize(start);
+                throw;
+            }
+            size_t length = out.size() - body;
+            if (framing == Framing::LengthPrefixed) {
+                if ((length >> 31u >> 1u) != 0) {
+                    out.resize(start);
+                    throw LengthError("Message too long for length prefix", length, 0xFFFFFFFFu);
+                }
+                for (size_t i = 0; i != 4; ++i) {
+                    out[start + i] = static_cast<char>(length >> (24u - 8u * i));
+                }
+            }
+            table.push_back({body - base, length});
+        }
+
+    public:
+        // Messages are appended after whatever out already holds; offsets count from that point
+        explicit BatchWriter(std::vector<char> & out_, Framing framing_ = Framing::None)
+            : out(out_), framing(framing_), base(out_.size()) { }
+
+        template <typename T>
+        BatchWriter & add(const T & message) {
+            append([&message](OStream<std::vector<char>, E> & os) { os << message; });
+            return *this;
+        }
+
+        // Adds one message made of whatever write(OStream &) encodes
+        template <typename F>
+        BatchWriter & add_with(F && write) {
+            append(std::forward<F>(write));
             return *this;
         }
 
+        const std::vector<BatchEntry> & entries() const {
+            return table;
+        }
+
+        size_t size() const {
+            return table.size();
+        }
+
+        ConstView message(size_t i) const {
+            return ConstView(out.data() + base + table[i].offset, table[i].length);
+        }
+
+        // The whole batch, prefixes included
+        ConstView data() const {
+            return ConstView(out.data() + base, out.size() - base);
+        }
+
+        // Drops the batch but keeps the buffer's capacity for the next one
+        void clear() {
+            out.resize(base);
+            table.clear();
+        }
+    };
+
+    // Walks a Framing::LengthPrefixed batch
+    class FramedReader {
+        ConstView data;
+        size_t pos = 0;
+
+    public:
+        explicit FramedReader(ConstView data_) : data(data_) { }
+
+        // Next message, or nothing at the end; a frame cut short throws EOFError
+        std::optional<ConstView> next() {
+            if (pos == data.size) {
+                return std::nullopt;
+            }
+            if (data.size - pos < 4) {
+                throw EOFError("EOF", data.size - pos, 4);
+            }
+            size_t length = 0;
+            for (size_t i = 0; i != 4; ++i) {
+                length = (length << 8u) | static_cast<unsigned char>(data.data[pos + i]);
+            }
+            if (data.size - pos - 4 < length) {
+                throw EOFError("EOF", data.size - pos - 4, length);
+            }
+            std::optional<ConstView> message(std::in_place, data.data + pos + 4, length);
+            pos += 4 + length;
+            return message;
+        }
+    };
+
+    // One step of a path into an encoded message: an array index or a string map key
+    class PathStep {
+    public:
+        std::string_view key;
+        size_t index = 0;
+        bool is_key = false;
+
+        constexpr PathStep(size_t index_) : index(index_) { }
+
+        constexpr PathStep(int index_) : index(static_cast<size_t>(index_)) { }
+
+        constexpr PathStep(std::string_view key_) : key(key_), is_key(true) { }
+
+        constexpr PathStep(const char * key_) : key(key_), is_key(true) { }
+    };
+
+    enum class PatchResult {
+        Ok,
+        NeedsReencode,
+        NotFound,
+        TypeMismatch,
+    };
+
+    // Overwrites scalars inside an already encoded message as long as the new value fits the old slot
+    class Editor {
+        MutableView view;
+
+        static constexpr void store(char * p, unsigned long long value, size_t width) {
+            for (size_t i = width; i != 0; --i) {
+                p[i - 1] = static_cast<char>(static_cast<unsigned char>(value & 0xFFu));
+                value >>= 8u;
+            }
+        }
+
+        constexpr void check_slot(size_t offset, size_t width) const {
+            if (offset + 1 + width > view.size)
+                throw EOFError("EOF", view.size - offset - 1, width);
+        }
+
+        template <typename T>
+        constexpr PatchResult set_integer(size_t offset, T value) {
+            char * p = view.data + offset;
+            auto c = static_cast<unsigned char>(*p);
+            bool negative = false;
+            if constexpr (std::is_signed_v<T>) {
+                negative = value < 0;
+            }
+            auto u = static_cast<unsigned long long>(value);
+            auto s = static_cast<long long>(value);
+            if (c <= 0x7Fu || c >= 0xE0u) {
+                if (negative ? s >= -32 : u <= 0x7Fu) {
+                    *p = static_cast<char>(static_cast<unsigned char>(u & 0xFFu));
+                    return PatchResult::Ok;
+                }
+                return PatchResult::NeedsReencode;
+            }
+            size_t shift = 0;
+            switch (c) {
+                case 0xcc: case 0xd0:
+                    shift = 0;
+                    break;
+                case 0xcd: case 0xd1:
+                    shift = 1;
+                    break;
+                case 0xce: case 0xd2:
+                    shift = 2;
+                    break;
+                case 0xcf: case 0xd3:
+                    shift = 3;
+                    break;
+                default:
+                    return PatchResult::TypeMismatch;
+            }
+            size_t width = 1u << shift;
+            check_slot(offset, width);
+            size_t bits = 8 * width;
+            if (!negative && (bits == 64 || u < (1ull << bits))) {
+                *p = static_cast<char>(0xccu + shift);
+            } else if (negative && (bits == 64 || s >= -(1ll << (bits - 1)))) {
+                *p = static_cast<char>(0xd0u + shift);
+            } else {
+                return PatchResult::NeedsReencode;
+            }
+            store(p + 1, u, width);
+            return PatchResult::Ok;
+        }
+
+        constexpr PatchResult set_floating(size_t offset, double value, bool single) {
+            char * p = view.data + offset;
+            switch (*p) {
+                case '\xca': {
+                    auto f = static_cast<float>(value);
+                    if (!single && static_cast<double>(f) != value && value == value) {
+                        return PatchResult::NeedsReencode;
+                    }
+                    check_slot(offset, 4);
+                    FHelper bin_val{};
+                    bin_val.f = f;
+                    store(p + 1, bin_val.u, 4);
+                    return PatchResult::Ok;
+                }
+                case '\xcb': {
+                    check_slot(offset, 8);
+                    DHelper bin_val{};
+                    bin_val.f = value;
+                    store(p + 1, bin_val.u, 8);
+                    return PatchResult::Ok;
+                }
+                default:
+                    return PatchResult::TypeMismatch;
+            }
+        }
+
+    public:
+        explicit constexpr Editor(MutableView mv) : view(mv) { }
+
+        // Offset of the value at path, navigating with the same header and skip logic as IStream
+        template <typename Path>
+        [[gnu::noinline]] constexpr std::optional<size_t> find(const Path & path) const {
+            IStream is{ConstView(view)};
+            for (const PathStep & step : path) {
+                if (step.is_key) {
+                    size_t size = is.read_map_header();
+                    bool found = false;
+                    for (size_t i = 0; i != size && !found; ++i) {
+                        is.check_eof();
+                        if ((static_cast<unsigned char>(*is.current_position) & 0xE0u) == 0xA0u ||
+                            (*is.current_position >= '\xd9' && *is.current_position <= '\xdb')) {
+                            std::string_view key;
+                            is >> key;
+                            found = key == step.key;
+                        } else {
+                            is.skip();
+                        }
+                        if (!found) {
+                            is.skip();
+                        }
+                    }
+                    if (!found) {
+                        return std::nullopt;
+                    }
+                } else {
+                    size_t size = is.read_array_header();
+                    if (step.index >= size) {
+                        return std::nullopt;
+                    }
+                    for (size_t i = 0; i != step.index; ++i) {
+                        is.skip();
+                    }
+                }
+            }
+            is.check_eof();
+            return static_cast<size_t>(is.current_position - is.data.data);
+        }
+
+        constexpr std::optional<size_t> find(std::initializer_list<PathStep> path) const {
+            return find<std::initializer_list<PathStep>>(path);
+        }
+
+        template <typename T, typename Path>
+        constexpr PatchResult set(const Path & path, T value) {
+            auto offset = find(path);
+            if (!offset) {
+                return PatchResult::NotFound;
+            }
+            if constexpr (std::is_same_v<T, bool>) {
+                char & c = view.data[*offset];
+                if (c != '\xc2' && c != '\xc3') {
+                    return PatchResult::TypeMismatch;
+                }
+                c = value ? '\xc3' : '\xc2';
+                return PatchResult::Ok;
+            } else if constexpr (std::is_floating_point_v<T>) {
+                return set_floating(*offset, static_cast<double>(value), std::is_same_v<T, float>);
+            } else {
+                static_assert(std::is_integral_v<T>, "Only scalars can be patched in place");
+                return set_integer(*offset, value);
+            }
+        }
 
+        template <typename T>
+        constexpr PatchResult set(std::initializer_list<PathStep> path, T value) {
+            return set<T, std::initializer_list<PathStep>>(path, value);
+        }
     };
 
 }
@@ -0,0 +1,570 @@
+#pragma once
+
+#if __cplusplus < 202002L
+#error "msgpackcpp_async.hpp needs C++20 coroutines"
+#endif
+
+#include <algorithm>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "msgpackcpp.hpp"
+
+namespace msgpackcpp {
+
+    // Lazily started coroutine; awaiting it runs it and yields its result
+    template <typename T = void>
+    class Task;
+
+    namespace detail {
+        template <typename T>
+        struct TaskPromiseBase {
+            std::coroutine_handle<> continuation = std::noop_coroutine();
+            std::exception_ptr error;
+
+            std::suspend_always initial_suspend() noexcept {
+                return {};
+            }
+
+            struct FinalAwaiter {
+                bool await_ready() noexcept {
+                    return false;
+                }
+
+                template <typename P>
+                std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept {
+                    return h.promise().continuation;
+                }
+
+                void await_resume() noexcept { }
+            };
+
+            FinalAwaiter final_suspend() noexcept {
+                return {};
+            }
+
+            void unhandled_exception() noexcept {
+                error = std::current_exception();
+            }
+        };
+
+        template <typename T>
+        struct TaskPromise : TaskPromiseBase<T> {
+            std::optional<T> value;
+
+            Task<T> get_return_object() noexcept;
+
+            template <typename U>
+            void return_value(U && v) {
+                value.emplace(std::forward<U>(v));
+            }
+
+            T result() {
+                if (this->error) {
+                    std::rethrow_exception(this->error);
+                }
+                return std::move(*value);
+            }
+        };
+
+        template <>
+        struct TaskPromise<void> : TaskPromiseBase<void> {
+            Task<void> get_return_object() noexcept;
+
+            void return_void() noexcept { }
+
+            void result() {
+                if (this->error) {
+                    std::rethrow_exception(this->error);
+                }
+            }
+        };
+    }
+
+    template <typename T>
+    class Task {
+    public:
+        using promise_type = detail::TaskPromise<T>;
+
+    private:
+        std::coroutine_handle<promise_type> handle;
+
+    public:
+        explicit Task(std::coroutine_handle<promise_type> h) noexcept : handle(h) { }
+
+        Task(Task && other) noexcept : handle(std::exchange(other.handle, nullptr)) { }
+
+        Task & operator=(Task && other) noexcept {
+            std::swap(handle, other.handle);
+            return *this;
+        }
+
+        ~Task() {
+            if (handle) {
+                handle.destroy();
+            }
+        }
+
+        bool await_ready() const noexcept {
+            return false;
+        }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+            handle.promise().continuation = awaiting;
+            return handle;
+        }
+
+        T await_resume() {
+            return handle.promise().result();
+        }
+    };
+
+    namespace detail {
+        template <typename T>
+        Task<T> TaskPromise<T>::get_return_object() noexcept {
+            return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+        }
+
+        inline Task<void> TaskPromise<void>::get_return_object() noexcept {
+            return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+        }
+    }
+
+    // Single-threaded epoll loop: resumes coroutines when their fds become ready.
+    // A spawned task that throws ends on its own: the exception goes to the on_task_error handler, if one
+    // is set, and the loop carries on serving every other task.
+    class EventLoop {
+        struct Waiters {
+            std::coroutine_handle<> reader;
+            std::coroutine_handle<> writer;
+            bool registered = false;
+        };
+
+        struct Detached {
+            struct promise_type {
+                EventLoop * loop = nullptr;
+
+                Detached get_return_object() noexcept {
+                    return {std::coroutine_handle<promise_type>::from_promise(*this)};
+                }
+
+                std::suspend_always initial_suspend() noexcept {
+                    return {};
+                }
+
+                std::suspend_never final_suspend() noexcept {
+                    return {};
+                }
+
+                void return_void() noexcept { }
+
+                void unhandled_exception() noexcept {
+                    ++loop->failures;
+                    if (loop->error_handler) {
+                        loop->error_handler(std::current_exception());
+                    }
+                }
+            };
+
+            std::coroutine_handle<promise_type> handle;
+        };
+
+        int epfd;
+        bool stopped = false;
+        size_t live_tasks = 0;
+        size_t waiting = 0;
+        size_t failures = 0;
+        std::function<void(std::exception_ptr)> error_handler;
+        std::deque<std::coroutine_handle<>> ready;
+        std::vector<std::function<void()>> tick_hooks;
+        std::vector<std::function<void()>> deferred;
+        std::unordered_map<int, Waiters> waiters;
+
+        Detached run_detached(Task<void> task) {
+            struct Finish {
+                size_t & live;
+
+                ~Finish() {
+                    --live;
+                }
+            } finish{live_tasks};
+            co_await task;
+        }
+
+        void arm(int fd) {
+            auto & w = waiters[fd];
+            epoll_event ev{};
+            ev.events = EPOLLONESHOT | (w.reader ? EPOLLIN : 0u) | (w.writer ? EPOLLOUT : 0u);
+            ev.data.fd = fd;
+            if (::epoll_ctl(epfd, w.registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, fd, &ev) != 0) {
+                throw std::system_error(errno, std::generic_category(), "epoll_ctl");
+            }
+            w.registered = true;
+        }
+
+    public:
+        struct FdAwaiter {
+            EventLoop & loop;
+            int fd;
+            bool write;
+
+            bool await_ready() const noexcept {
+                return false;
+            }
+
+            // One coroutine at a time may wait on each direction of an fd
+            void await_suspend(std::coroutine_handle<> h) {
+                auto & w = loop.waiters[fd];
+                auto & slot = write ? w.writer : w.reader;
+                if (slot) {
+                    throw std::logic_error(write ? "fd already has a writer waiting" : "fd already has a reader waiting");
+                }
+                ++loop.waiting;
+                slot = h;
+                loop.arm(fd);
+            }
+
+            void await_resume() const noexcept { }
+        };
+
+        EventLoop() : epfd(::epoll_create1(EPOLL_CLOEXEC)) {
+            if (epfd == -1) {
+                throw std::system_error(errno, std::generic_category(), "epoll_create1");
+            }
+        }
+
+        EventLoop(const EventLoop &) = delete;
+        EventLoop & operator=(const EventLoop &) = delete;
+
+        ~EventLoop() {
+            ::close(epfd);
+        }
+
+        FdAwaiter readable(int fd) {
+            return {*this, fd, false};
+        }
+
+        FdAwaiter writable(int fd) {
+            return {*this, fd, true};
+        }
+
+        // Must be called before closing an fd that was awaited on. Coroutines still waiting on it are
+        // resumed on the next tick, so they find out the fd is gone instead of waiting forever.
+        void forget(int fd) {
+            auto it = waiters.find(fd);
+            if (it != waiters.end()) {
+                if (it->second.registered) {
+                    ::epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+                }
+                for (auto h : {it->second.reader, it->second.writer}) {
+                    if (h) {
+                        --waiting;
+                        ready.push_back(h);
+                    }
+                }
+                waiters.erase(it);
+            }
+        }
+
+        // Starts task on the next tick; the loop keeps it alive until it finishes
+        void spawn(Task<void> task) {
+            auto d = run_detached(std::move(task));
+            d.handle.promise().loop = this;
+            ++live_tasks;
+            ready.push_back(d.handle);
+        }
+
+        void post(std::coroutine_handle<> h) {
+            ready.push_back(h);
+        }
+
+        // Runs after every coroutine made ready in a tick has run, before blocking in epoll
+        void on_tick(std::function<void()> hook) {
+            tick_hooks.push_back(std::move(hook));
+        }
+
+        // Like on_tick, but runs only once, at the end of the current tick
+        void defer(std::function<void()> callback) {
+            deferred.push_back(std::move(callback));
+        }
+
+        // Receives the exception of every spawned task that fails; it runs inside the loop and must not throw
+        void on_task_error(std::function<void(std::exception_ptr)> handler) {
+            error_handler = std::move(handler);
+        }
+
+        // Number of spawned tasks that ended with an exception
+        size_t failed_tasks() const {
+            return failures;
+        }
+
+        void stop() {
+            stopped = true;
+        }
+
+        // Runs until stop() or until no spawned task is left
+        void run() {
+            stopped = false;
+            epoll_event events[64];
+            while (!stopped && live_tasks != 0) {
+                while (!ready.empty() && !stopped) {
+                    auto h = ready.front();
+                    ready.pop_front();
+                    h.resume();
+                }
+                for (auto & hook : tick_hooks) {
+                    hook();
+                }
+                for (auto callbacks = std::exchange(deferred, {}); auto & callback : callbacks) {
+                    callback();
+                }
+                if (stopped || live_tasks == 0 || !ready.empty()) {
+                    continue;
+                }
+                if (waiting == 0) {
+                    break;
+                }
+                int n = ::epoll_wait(epfd, events, 64, -1);
+                if (n < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::system_error(errno, std::generic_category(), "epoll_wait");
+                }
+                for (int i = 0; i != n; ++i) {
+                    int fd = events[i].data.fd;
+                    auto & w = waiters[fd];
+                    bool failed = (events[i].events & (EPOLLERR | EPOLLHUP)) != 0;
+                    if (w.reader && (failed || (events[i].events & EPOLLIN))) {
+                        ready.push_back(std::exchange(w.reader, nullptr));
+                        --waiting;
+                    }
+                    if (w.writer && (failed || (events[i].events & EPOLLOUT))) {
+                        ready.push_back(std::exchange(w.writer, nullptr));
+                        --waiting;
+                    }
+                    if (w.reader || w.writer) {
+                        arm(fd);
+                    }
+                }
+            }
+        }
+    };
+
+    inline void set_nonblocking(int fd) {
+        int flags = ::fcntl(fd, F_GETFL, 0);
+        if (flags == -1 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            throw std::system_error(errno, std::generic_category(), "fcntl");
+        }
+    }
+
+    // Buffers bytes from a non-blocking fd and yields one decoded message at a time
+    class AsyncReader {
+        EventLoop & loop;
+        int fd;
+        std::vector<char> buffer;
+        size_t begin = 0;
+        size_t end = 0;
+        size_t max_message;
+        // Framing progress through the message at begin: bytes already walked and values still missing
+        size_t scanned = 0;
+        size_t missing = 1;
+
+    public:
+        AsyncReader(EventLoop & loop_, int fd_, size_t initial_capacity = 4096, size_t max_message_ = 64u << 20u)
+            : loop(loop_), fd(fd_), buffer(initial_capacity), max_message(max_message_) { }
+
+        // Size of the next complete message if it is already buffered. Framing resumes where the previous
+        // call stopped, so a message arriving in many reads is walked once. A message still incomplete
+        // after max_message bytes raises LimitError; a byte that is no msgpack format raises TypeError,
+        // and so does every later call, since the stream cannot be resynchronized.
+        std::optional<size_t> buffered_message() {
+            IStream is(ConstView(buffer.data() + begin + scanned, end - begin - scanned));
+            bool complete = false;
+            try {
+                complete = is.try_skip(missing);
+            } catch (const TypeError &) {
+                // try_skip leaves its progress unspecified; start over so the next call reports the same byte
+                scanned = 0;
+                missing = 1;
+                throw;
+            }
+            scanned += is.tell();
+            if (!complete) {
+                if (end - begin >= max_message) {
+                    throw LimitError("Message too large", end - begin, max_message);
+                }
+                return std::nullopt;
+            }
+            if (scanned > max_message) {
+                throw LimitError("Message too large", scanned, max_message);
+            }
+            return scanned;
+        }
+
+        ConstView pending() const {
+            return ConstView(buffer.data() + begin, end - begin);
+        }
+
+        void consume(size_t n) {
+            begin += n;
+            scanned = 0;
+            missing = 1;
+            if (begin == end) {
+                begin = end = 0;
+            }
+        }
+
+        // Reads more bytes, waiting for readiness; false once the peer has closed
+        Task<bool> fill() {
+            if (begin != 0 && end - begin < buffer.size() / 2) {
+                std::copy(buffer.begin() + begin, buffer.begin() + end, buffer.begin());
+                end -= begin;
+                begin = 0;
+            }
+            if (end == buffer.size()) {
+                buffer.resize(buffer.size() * 2);
+            }
+            for (;;) {
+                ssize_t n = ::read(fd, buffer.data() + end, buffer.size() - end);
+                if (n > 0) {
+                    end += static_cast<size_t>(n);
+                    co_return true;
+                }
+                if (n == 0) {
+                    co_return false;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    co_await loop.readable(fd);
+                } else if (errno != EINTR) {
+                    throw std::system_error(errno, std::generic_category(), "read");
+                }
+            }
+        }
+
+        // Next message decoded as T, or nothing if the peer closed cleanly between messages
+        template <typename T>
+        Task<std::optional<T>> next() {
+            for (;;) {
+                if (auto size = buffered_message()) {
+                    T value{};
+                    IStream is(ConstView(buffer.data() + begin, *size));
+                    is >> value;
+                    consume(*size);
+                    co_return std::optional<T>(std::move(value));
+                }
+                if (!co_await fill()) {
+                    if (begin != end) {
+                        throw EOFError("Connection closed inside a message", end - begin, end - begin + 1);
+                    }
+                    co_return std::nullopt;
+                }
+            }
+        }
+    };
+
+    // Encodes values with OStream into an output buffer and drains it to a non-blocking fd.
+    // Several tasks may send through one writer: one flush() writes at a time and the others wait for it.
+    class AsyncWriter {
+        EventLoop & loop;
+        int fd;
+        std::vector<char> buffer;
+        size_t sent = 0;
+        bool flushing = false;
+        std::vector<std::coroutine_handle<>> flush_waiters;
+        // First write error; the fd is unusable afterwards, so every later flush() rethrows it
+        std::exception_ptr failure;
+
+        struct FlushWait {
+            AsyncWriter & writer;
+
+            bool await_ready() const noexcept {
+                return !writer.flushing;
+            }
+
+            void await_suspend(std::coroutine_handle<> h) {
+                writer.flush_waiters.push_back(h);
+            }
+
+            void await_resume() const noexcept { }
+        };
+
+        void finish_flush() {
+            flushing = false;
+            for (auto h : std::exchange(flush_waiters, {})) {
+                loop.post(h);
+            }
+        }
+
+    public:
+        AsyncWriter(EventLoop & loop_, int fd_) : loop(loop_), fd(fd_) { }
+
+        AsyncWriter(const AsyncWriter &) = delete;
+        AsyncWriter & operator=(const AsyncWriter &) = delete;
+
+        // Not inlined: a writer usually lives in a coroutine frame, whose cleanup paths are cold
+        [[gnu::noinline]] ~AsyncWriter() = default;
+
+        // Encodes value without writing; flush() sends everything queued so far
+        template <typename T>
+        void queue(const T & value) {
+            OStream os(buffer);
+            os << value;
+        }
+
+        size_t queued() const {
+            return buffer.size() - sent;
+        }
+
+        // Sends everything queued so far. A flush already running sends bytes queued while it runs, so a
+        // caller that finds one waits for it instead of writing.
+        Task<void> flush() {
+            while (flushing) {
+                co_await FlushWait{*this};
+            }
+            if (failure) {
+                std::rethrow_exception(failure);
+            }
+            flushing = true;
+            try {
+                while (sent != buffer.size()) {
+                    ssize_t n = ::write(fd, buffer.data() + sent, buffer.size() - sent);
+                    if (n >= 0) {
+                        sent += static_cast<size_t>(n);
+                    } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        co_await loop.writable(fd);
+                    } else if (errno != EINTR) {
+                        throw std::system_error(errno, std::generic_category(), "write");
+                    }
+                }
+            } catch (...) {
+                failure = std::current_exception();
+                finish_flush();
+                throw;
+            }
+            buffer.clear();
+            sent = 0;
+            finish_flush();
+        }
+
+        template <typename T>
+        Task<void> send(T value) {
+            queue(value);
+            co_await flush();
+        }
+    };
+
+}
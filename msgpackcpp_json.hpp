@@ -0,0 +1,680 @@
+#pragma once
+
+#include <charconv>
+#include <cmath>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "msgpackcpp.hpp"
+
+namespace msgpackcpp {
+
+    class JsonError : public std::exception {
+        const char * msg;
+        size_t offset;
+
+    public:
+        explicit JsonError(const char * msg_, size_t offset_) : msg(msg_), offset(offset_) { }
+
+        const char * what() const noexcept override {
+            return msg;
+        }
+
+        size_t getOffset() const noexcept {
+            return offset;
+        }
+    };
+
+    namespace json_detail {
+        template <class Sink, class = void>
+        struct has_range_insert : std::false_type { };
+
+        template <class Sink>
+        struct has_range_insert<Sink, std::void_t<decltype(std::declval<Sink &>().insert(
+                std::declval<Sink &>().end(), std::declval<const char *>(), std::declval<const char *>()))>>
+            : std::true_type { };
+
+        template <class Sink>
+        inline void append(Sink & out, const char * p, size_t n) {
+            if constexpr (has_range_insert<Sink>::value) {
+                out.insert(out.end(), p, p + n);
+            } else {
+                for (size_t i = 0; i != n; ++i) {
+                    out.push_back(p[i]);
+                }
+            }
+        }
+
+        template <class Sink>
+        inline void append(Sink & out, std::string_view s) {
+            append(out, s.data(), s.size());
+        }
+
+        constexpr bool needs_escape(unsigned char c) {
+            return c < 0x20u || c == '"' || c == '\\';
+        }
+
+        // Length of the leading run of s that can be copied into a JSON string as is
+        inline size_t clean_prefix(const char * s, size_t n) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128i quote = _mm_set1_epi8('"');
+            const __m128i backslash = _mm_set1_epi8('\\');
+            const __m128i control = _mm_set1_epi8(0x1F);
+            for (; i + 16 <= n; i += 16) {
+                __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s + i));
+                // max_epu8(c, 0x1F) == 0x1F exactly when c <= 0x1F, unsigned, so UTF-8 bytes pass
+                __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                                            _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+                if (int mask = _mm_movemask_epi8(hits); mask != 0) {
+                    return i + static_cast<size_t>(__builtin_ctz(static_cast<unsigned>(mask)));
+                }
+            }
+#endif
+            while (i != n && !needs_escape(static_cast<unsigned char>(s[i]))) {
+                ++i;
+            }
+            return i;
+        }
+
+        template <class Sink>
+        void write_escaped(Sink & out, std::string_view s) {
+            static constexpr char hex[] = "0123456789abcdef";
+            out.push_back('"');
+            const char * p = s.data();
+            size_t left = s.size();
+            while (left != 0) {
+                size_t clean = clean_prefix(p, left);
+                append(out, p, clean);
+                p += clean;
+                left -= clean;
+                if (left == 0) {
+                    break;
+                }
+                auto c = static_cast<unsigned char>(*p);
+                switch (c) {
+                    case '"': append(out, "\\\"", 2); break;
+                    case '\\': append(out, "\\\\", 2); break;
+                    case '\b': append(out, "\\b", 2); break;
+                    case '\f': append(out, "\\f", 2); break;
+                    case '\n': append(out, "\\n", 2); break;
+                    case '\r': append(out, "\\r", 2); break;
+                    case '\t': append(out, "\\t", 2); break;
+                    default: {
+                        char u[6] = {'\\', 'u', '0', '0', hex[c >> 4u], hex[c & 0xFu]};
+                        append(out, u, 6);
+                    }
+                }
+                ++p;
+                --left;
+            }
+            out.push_back('"');
+        }
+
+        template <class Sink>
+        void write_base64(Sink & out, const char * p, size_t n) {
+            static constexpr char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            out.push_back('"');
+            size_t i = 0;
+            for (; i + 3 <= n; i += 3) {
+                unsigned v = (static_cast<unsigned char>(p[i]) << 16u) | (static_cast<unsigned char>(p[i + 1]) << 8u) |
+                             static_cast<unsigned char>(p[i + 2]);
+                char quad[4] = {alphabet[v >> 18u], alphabet[(v >> 12u) & 63u], alphabet[(v >> 6u) & 63u], alphabet[v & 63u]};
+                append(out, quad, 4);
+            }
+            if (n - i == 1) {
+                unsigned v = static_cast<unsigned char>(p[i]) << 16u;
+                char quad[4] = {alphabet[v >> 18u], alphabet[(v >> 12u) & 63u], '=', '='};
+                append(out, quad, 4);
+            } else if (n - i == 2) {
+                unsigned v = (static_cast<unsigned char>(p[i]) << 16u) | (static_cast<unsigned char>(p[i + 1]) << 8u);
+                char quad[4] = {alphabet[v >> 18u], alphabet[(v >> 12u) & 63u], alphabet[(v >> 6u) & 63u], '='};
+                append(out, quad, 4);
+            }
+            out.push_back('"');
+        }
+
+        struct Frame {
+            size_t remaining;
+            bool map;
+            bool first = true;
+            bool key_next = true;
+        };
+    }
+
+    // Writes one encoded value as JSON in a single pass, without building a DOM.
+    // Binaries become base64 strings, extensions {"type":t,"data":base64}, non-finite floats null.
+    // Scalar map keys are quoted (binaries are already base64 strings); arrays, maps and extensions as keys
+    // are rejected.
+    template <class Sink>
+    class JsonWriter {
+        ConstView data;
+        IStream<> is;
+        Sink & out;
+        std::vector<json_detail::Frame> stack;
+
+        unsigned char peek() {
+            if (is.tell() >= data.size) {
+                is.skip();
+            }
+            return static_cast<unsigned char>(data.data[is.tell()]);
+        }
+
+        template <typename T>
+        void number(T value) {
+            char buf[32];
+            auto res = std::to_chars(buf, buf + sizeof(buf), value);
+            json_detail::append(out, buf, static_cast<size_t>(res.ptr - buf));
+            if constexpr (std::is_floating_point_v<T>) {
+                if (std::string_view(buf, static_cast<size_t>(res.ptr - buf)).find_first_of(".e") == std::string_view::npos) {
+                    json_detail::append(out, ".0", 2);
+                }
+            }
+        }
+
+        template <typename T>
+        void real() {
+            T value;
+            is >> value;
+            if (std::isfinite(value)) {
+                number(value);
+            } else {
+                json_detail::append(out, "null", 4);
+            }
+        }
+
+        // Skips a bin or ext and returns its payload, whose last header byte (the ext type) sits just before it
+        std::string_view payload(size_t header) {
+            size_t start = is.tell();
+            is.skip();
+            return std::string_view(data.data + start + header, is.tell() - start - header);
+        }
+
+        void scalar(unsigned char c) {
+            switch (c) {
+                case 0xc0:
+                    is.skip();
+                    json_detail::append(out, "null", 4);
+                    return;
+                case 0xc2:
+                case 0xc3:
+                    is.skip();
+                    json_detail::append(out, c == 0xc3 ? "true" : "false", c == 0xc3 ? 4 : 5);
+                    return;
+                case 0xca:
+                    real<float>();
+                    return;
+                case 0xcb:
+                    real<double>();
+                    return;
+                case 0xcc: case 0xcd: case 0xce: case 0xcf: {
+                    unsigned long long u;
+                    is >> u;
+                    number(u);
+                    return;
+                }
+                case 0xd0: case 0xd1: case 0xd2: case 0xd3: {
+                    long long i;
+                    is >> i;
+                    number(i);
+                    return;
+                }
+                case 0xc4: case 0xc5: case 0xc6: {
+                    auto bin = payload(c == 0xc4 ? 2 : c == 0xc5 ? 3 : 5);
+                    json_detail::write_base64(out, bin.data(), bin.size());
+                    return;
+                }
+                case 0xc7: case 0xc8: case 0xc9:
+                case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8: {
+                    size_t header = c >= 0xd4 ? 2 : c == 0xc7 ? 3 : c == 0xc8 ? 4 : 6;
+                    auto ext = payload(header);
+                    json_detail::append(out, "{\"type\":", 8);
+                    number(static_cast<int>(static_cast<signed char>(ext.data()[-1])));
+                    json_detail::append(out, ",\"data\":", 8);
+                    json_detail::write_base64(out, ext.data(), ext.size());
+                    out.push_back('}');
+                    return;
+                }
+                default:
+                    break;
+            }
+            if (c <= 0x7fu) {
+                is.skip();
+                number(static_cast<unsigned>(c));
+            } else if (c >= 0xe0u) {
+                long long i;
+                is >> i;
+                number(i);
+            } else if ((c & 0xE0u) == 0xA0u || (c >= 0xd9 && c <= 0xdb)) {
+                std::string_view s;
+                is >> s;
+                json_detail::write_escaped(out, s);
+            } else {
+                is.skip();
+            }
+        }
+
+        static bool is_container(unsigned char c) {
+            return (c & 0xE0u) == 0x80u || (c >= 0xdc && c <= 0xdf);
+        }
+
+        void value() {
+            unsigned char c = peek();
+            if ((c & 0xF0u) == 0x80u || c == 0xde || c == 0xdf) {
+                out.push_back('{');
+                stack.push_back({is.read_map_header(), true});
+            } else if (is_container(c)) {
+                out.push_back('[');
+                stack.push_back({is.read_array_header(), false});
+            } else {
+                scalar(c);
+            }
+        }
+
+        void key() {
+            unsigned char c = peek();
+            if (is_container(c)) {
+                throw TypeError("Map key must be a scalar", static_cast<char>(c));
+            }
+            if ((c >= 0xc7 && c <= 0xc9) || (c >= 0xd4 && c <= 0xd8)) {
+                throw TypeError("Map key must not be an extension", static_cast<char>(c));
+            }
+            bool quote = (c & 0xE0u) != 0xA0u && (c < 0xd9 || c > 0xdb) && (c < 0xc4 || c > 0xc6);
+            if (quote) {
+                out.push_back('"');
+            }
+            scalar(c);
+            if (quote) {
+                out.push_back('"');
+            }
+        }
+
+    public:
+        JsonWriter(ConstView data_, Sink & out_) : data(data_), is(data_), out(out_) { }
+
+        // Transcodes the next value; returns false once the data is exhausted
+        bool next() {
+            if (is.tell() == data.size) {
+                return false;
+            }
+            value();
+            while (!stack.empty()) {
+                auto & f = stack.back();
+                if (f.remaining == 0) {
+                    out.push_back(f.map ? '}' : ']');
+                    stack.pop_back();
+                    continue;
+                }
+                if (!f.first && (!f.map || f.key_next)) {
+                    out.push_back(',');
+                }
+                f.first = false;
+                if (f.map && f.key_next) {
+                    f.key_next = false;
+                    key();
+                    out.push_back(':');
+                    continue;
+                }
+                f.key_next = true;
+                --f.remaining;
+                value();
+            }
+            return true;
+        }
+
+        size_t tell() const {
+            return is.tell();
+        }
+    };
+
+    // Transcodes the first value in data and returns the number of bytes it took
+    template <class Sink>
+    size_t to_json(ConstView data, Sink & out) {
+        JsonWriter<Sink> writer(data, out);
+        writer.next();
+        return writer.tell();
+    }
+
+    // Parses JSON text and encodes it through an OStream. Integers keep their integer type,
+    // every other number becomes a double; container lengths come from one scan ahead of each top-level value.
+    template <class MV, Encoding E, class Policy>
+    class JsonReader {
+        std::string_view text;
+        OStream<MV, E, Policy> & os;
+        size_t pos = 0;
+        std::string scratch;
+        std::vector<json_detail::Frame> stack;
+        // Element counts of the containers in the current value, in the order their brackets open
+        std::vector<size_t> counts;
+        size_t next_count = 0;
+        // Containers open during the scan: index into counts, and whether an element was seen yet
+        std::vector<std::pair<size_t, bool>> open;
+
+        [[noreturn]] void fail(const char * msg) const {
+            throw JsonError(msg, pos);
+        }
+
+        void skip_ws() {
+            while (pos != text.size() && (text[pos] == ' ' || text[pos] == '\n' || text[pos] == '\r' || text[pos] == '\t')) {
+                ++pos;
+            }
+        }
+
+        void expect(char c) {
+            skip_ws();
+            if (pos == text.size() || text[pos] != c) {
+                fail("Unexpected character");
+            }
+            ++pos;
+        }
+
+        void literal(std::string_view word) {
+            if (text.substr(pos, word.size()) != word) {
+                fail("Invalid literal");
+            }
+            pos += word.size();
+        }
+
+        // Counts the elements of every container in the value at pos in a single pass, however deep it nests
+        void count_elements() {
+            counts.clear();
+            next_count = 0;
+            open.clear();
+            for (size_t p = pos; p != text.size(); ++p) {
+                char c = text[p];
+                if (c == ' ' || c == '\n' || c == '\r' || c == '\t') {
+                    continue;
+                }
+                if (!open.empty() && !open.back().second && c != ']' && c != '}') {
+                    open.back().second = true;
+                    counts[open.back().first] = 1;
+                }
+                switch (c) {
+                    case '"':
+                        for (++p; p != text.size() && text[p] != '"'; ++p) {
+                            p += text[p] == '\\';
+                        }
+                        if (p >= text.size()) {
+                            throw JsonError("Unterminated string", text.size());
+                        }
+                        break;
+                    case '[':
+                    case '{':
+                        open.emplace_back(counts.size(), false);
+                        counts.push_back(0);
+                        break;
+                    case ']':
+                    case '}':
+                        if (open.empty()) {
+                            return;
+                        }
+                        open.pop_back();
+                        if (open.empty()) {
+                            return;
+                        }
+                        break;
+                    case ',':
+                        if (!open.empty()) {
+                            ++counts[open.back().first];
+                        }
+                        break;
+                    default:
+                        break;
+                }
+                if (open.empty()) {
+                    return;
+                }
+            }
+            if (!open.empty()) {
+                throw JsonError("Unterminated container", text.size());
+            }
+        }
+
+        static unsigned hex_digit(char c) {
+            if (c >= '0' && c <= '9') {
+                return static_cast<unsigned>(c - '0');
+            }
+            if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f') {
+                return static_cast<unsigned>((c | 0x20) - 'a' + 10);
+            }
+            return 16;
+        }
+
+        unsigned hex4() {
+            if (text.size() - pos < 4) {
+                fail("Bad unicode escape");
+            }
+            unsigned v = 0;
+            for (size_t i = 0; i != 4; ++i) {
+                unsigned d = hex_digit(text[pos++]);
+                if (d == 16) {
+                    fail("Bad unicode escape");
+                }
+                v = (v << 4u) | d;
+            }
+            return v;
+        }
+
+        void utf8(unsigned cp) {
+            if (cp < 0x80) {
+                scratch.push_back(static_cast<char>(cp));
+            } else if (cp < 0x800) {
+                scratch.push_back(static_cast<char>(0xC0 | (cp >> 6u)));
+                scratch.push_back(static_cast<char>(0x80 | (cp & 0x3Fu)));
+            } else if (cp < 0x10000) {
+                scratch.push_back(static_cast<char>(0xE0 | (cp >> 12u)));
+                scratch.push_back(static_cast<char>(0x80 | ((cp >> 6u) & 0x3Fu)));
+                scratch.push_back(static_cast<char>(0x80 | (cp & 0x3Fu)));
+            } else {
+                scratch.push_back(static_cast<char>(0xF0 | (cp >> 18u)));
+                scratch.push_back(static_cast<char>(0x80 | ((cp >> 12u) & 0x3Fu)));
+                scratch.push_back(static_cast<char>(0x80 | ((cp >> 6u) & 0x3Fu)));
+                scratch.push_back(static_cast<char>(0x80 | (cp & 0x3Fu)));
+            }
+        }
+
+        // Strings without escapes are passed through as views of the input
+        std::string_view string() {
+            expect('"');
+            size_t start = pos;
+            while (pos != text.size() && text[pos] != '"' && text[pos] != '\\') {
+                if (static_cast<unsigned char>(text[pos]) < 0x20u) {
+                    fail("Control character in string");
+                }
+                ++pos;
+            }
+            if (pos == text.size()) {
+                fail("Unterminated string");
+            }
+            if (text[pos] == '"') {
+                return text.substr(start, pos++ - start);
+            }
+            scratch.assign(text.data() + start, pos - start);
+            while (pos != text.size() && text[pos] != '"') {
+                char c = text[pos++];
+                if (static_cast<unsigned char>(c) < 0x20u) {
+                    fail("Control character in string");
+                }
+                if (c != '\\') {
+                    scratch.push_back(c);
+                    continue;
+                }
+                if (pos == text.size()) {
+                    break;
+                }
+                switch (text[pos++]) {
+                    case '"': scratch.push_back('"'); break;
+                    case '\\': scratch.push_back('\\'); break;
+                    case '/': scratch.push_back('/'); break;
+                    case 'b': scratch.push_back('\b'); break;
+                    case 'f': scratch.push_back('\f'); break;
+                    case 'n': scratch.push_back('\n'); break;
+                    case 'r': scratch.push_back('\r'); break;
+                    case 't': scratch.push_back('\t'); break;
+                    case 'u': {
+                        unsigned cp = hex4();
+                        if (cp >= 0xD800 && cp < 0xDC00 && text.substr(pos, 2) == "\\u") {
+                            pos += 2;
+                            unsigned low = hex4();
+                            if (low < 0xDC00 || low >= 0xE000) {
+                                fail("Bad surrogate pair");
+                            }
+                            cp = 0x10000 + ((cp - 0xD800) << 10u) + (low - 0xDC00);
+                        }
+                        utf8(cp);
+                        break;
+                    }
+                    default:
+                        fail("Bad escape");
+                }
+            }
+            if (pos == text.size()) {
+                fail("Unterminated string");
+            }
+            ++pos;
+            return scratch;
+        }
+
+        void number() {
+            size_t start = pos;
+            bool integral = true;
+            pos += text[pos] == '-';
+            while (pos != text.size()) {
+                char c = text[pos];
+                if (c == '.' || c == 'e' || c == 'E' || c == '+' || (c == '-' && pos != start)) {
+                    integral = false;
+                } else if (c < '0' || c > '9') {
+                    break;
+                }
+                ++pos;
+            }
+            const char * first = text.data() + start;
+            const char * last = text.data() + pos;
+            if (integral) {
+                if (*first == '-') {
+                    long long i;
+                    if (auto res = std::from_chars(first, last, i); res.ec == std::errc() && res.ptr == last) {
+                        os << i;
+                        return;
+                    }
+                } else {
+                    unsigned long long u;
+                    if (auto res = std::from_chars(first, last, u); res.ec == std::errc() && res.ptr == last) {
+                        os << u;
+                        return;
+                    }
+                }
+            }
+            double d;
+            auto res = std::from_chars(first, last, d);
+            if (res.ec != std::errc() || res.ptr != last) {
+                pos = start;
+                fail("Bad number");
+            }
+            os << d;
+        }
+
+        void value() {
+            skip_ws();
+            if (pos == text.size()) {
+                fail("Unexpected end of input");
+            }
+            switch (text[pos]) {
+                case '[':
+                    ++pos;
+                    stack.push_back({counts[next_count++], false});
+                    os.write_array_header(stack.back().remaining);
+                    return;
+                case '{':
+                    ++pos;
+                    stack.push_back({counts[next_count++], true});
+                    os.write_map_header(stack.back().remaining);
+                    return;
+                case '"':
+                    os << string();
+                    return;
+                case 't':
+                    literal("true");
+                    os << true;
+                    return;
+                case 'f':
+                    literal("false");
+                    os << false;
+                    return;
+                case 'n':
+                    literal("null");
+                    os << Nil{};
+                    return;
+                default:
+                    if (text[pos] == '-' || (text[pos] >= '0' && text[pos] <= '9')) {
+                        number();
+                        return;
+                    }
+                    fail("Unexpected character");
+            }
+        }
+
+    public:
+        JsonReader(std::string_view text_, OStream<MV, E, Policy> & os_) : text(text_), os(os_) { }
+
+        // Encodes the next JSON value; returns false once only whitespace is left
+        bool next() {
+            skip_ws();
+            if (pos == text.size()) {
+                return false;
+            }
+            count_elements();
+            value();
+            while (!stack.empty()) {
+                auto & f = stack.back();
+                if (f.remaining == 0) {
+                    expect(f.map ? '}' : ']');
+                    stack.pop_back();
+                    continue;
+                }
+                if (!f.first) {
+                    expect(',');
+                }
+                f.first = false;
+                --f.remaining;
+                if (f.map) {
+                    os << string();
+                    expect(':');
+                }
+                value();
+            }
+            return true;
+        }
+
+        // True when only whitespace is left
+        bool at_end() {
+            skip_ws();
+            return pos == text.size();
+        }
+
+        size_t tell() const {
+            return pos;
+        }
+    };
+
+    // Encodes a single JSON document; anything but whitespace after it is an error
+    template <class MV, Encoding E, class Policy>
+    void from_json(std::string_view text, OStream<MV, E, Policy> & os) {
+        JsonReader<MV, E, Policy> reader(text, os);
+        if (!reader.next()) {
+            throw JsonError("Empty document", 0);
+        }
+        if (!reader.at_end()) {
+            throw JsonError("Trailing data", reader.tell());
+        }
+    }
+
+}
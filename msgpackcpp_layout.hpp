@@ -0,0 +1,208 @@
+#pragma once
+
+#include <array>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "msgpackcpp.hpp"
+
+namespace msgpackcpp {
+
+    // Decoder for a fixed tuple type that remembers the shapes of recent messages: the lead (format) byte
+    // of every value in order, with the width each one implies. A message matching a known shape is decoded
+    // by checking each lead byte against the shape and loading the value at the width found there, with no
+    // dispatch on the format. Anything else goes through IStream and its shape is learned for next time.
+    // Shapes are tried most recently used first.
+    template <class T, size_t Shapes = 4>
+    class LayoutCache {
+        struct Step {
+            // Lead byte under mask; the mask leaves out the bits a fix format spends on its value or length
+            unsigned char lead;
+            unsigned char mask;
+            // Bytes after the lead byte: the value for numbers, the length for strings, binaries and arrays
+            unsigned char width;
+        };
+
+        using Shape = std::vector<Step>;
+
+        template <class V>
+        struct is_tuple : std::false_type { };
+
+        template <class... Args>
+        struct is_tuple<std::tuple<Args...>> : std::true_type { };
+
+        static_assert(is_tuple<T>::value, "LayoutCache decodes tuples");
+
+        std::array<Shape, Shapes> shapes;
+        size_t known = 0;
+        size_t hit_count = 0;
+        size_t miss_count = 0;
+
+        static constexpr unsigned char width_of(unsigned char lead) {
+            switch (lead) {
+                case 0xcc: case 0xd0: case 0xd9: case 0xc4:
+                    return 1;
+                case 0xcd: case 0xd1: case 0xda: case 0xc5: case 0xdc:
+                    return 2;
+                case 0xca: case 0xce: case 0xd2: case 0xdb: case 0xc6: case 0xdd:
+                    return 4;
+                case 0xcb: case 0xcf: case 0xd3:
+                    return 8;
+                default:
+                    return 0;
+            }
+        }
+
+        static constexpr unsigned char mask_of(unsigned char lead) {
+            if (lead < 0x80u) {
+                return 0x80;
+            }
+            if (lead >= 0xe0u || (lead & 0xE0u) == 0xA0u) {
+                return 0xE0;
+            }
+            if ((lead & 0xE0u) == 0x80u) {
+                return 0xF0;
+            }
+            return lead == 0xc2 || lead == 0xc3 ? 0xFE : 0xFF;
+        }
+
+        static unsigned long long load(const char * p, unsigned width) {
+            auto b = [p](unsigned i) {
+                return static_cast<unsigned long long>(static_cast<unsigned char>(p[i]));
+            };
+            switch (width) {
+                case 1:
+                    return b(0);
+                case 2:
+                    return b(0) << 8u | b(1);
+                case 4:
+                    return b(0) << 24u | b(1) << 16u | b(2) << 8u | b(3);
+                default:
+                    return b(0) << 56u | b(1) << 48u | b(2) << 40u | b(3) << 32u | b(4) << 24u | b(5) << 16u | b(6) << 8u | b(7);
+            }
+        }
+
+        // Shape of a message that IStream just decoded as V
+        template <class V>
+        static void learn(IStream<> & is, const char * base, Shape & shape) {
+            auto lead = static_cast<unsigned char>(base[is.tell()]);
+            shape.push_back({static_cast<unsigned char>(lead & mask_of(lead)), mask_of(lead), width_of(lead)});
+            if constexpr (is_tuple<V>::value) {
+                is.read_array_header();
+                learn_tuple<V>(is, base, shape, std::make_index_sequence<std::tuple_size_v<V>>{});
+            } else {
+                is.skip();
+            }
+        }
+
+        template <class V, size_t... I>
+        static void learn_tuple(IStream<> & is, const char * base, Shape & shape, std::index_sequence<I...>) {
+            (learn<std::tuple_element_t<I, V>>(is, base, shape), ...);
+        }
+
+        // Decodes one value along the shape; false as soon as the message departs from it
+        template <class V>
+        static bool follow(const Step *& step, const char *& p, const char * end, V & value) {
+            const Step s = *step++;
+            if (p == end || (static_cast<unsigned char>(*p) & s.mask) != s.lead || static_cast<size_t>(end - p) <= s.width) {
+                return false;
+            }
+            auto lead = static_cast<unsigned char>(*p);
+            const char * body = p + 1;
+            if constexpr (is_tuple<V>::value) {
+                if (s.width != 0 ? load(body, s.width) != std::tuple_size_v<V> : (lead & 0x0Fu) != std::tuple_size_v<V>) {
+                    return false;
+                }
+                p = body + s.width;
+                return std::apply([&](auto &... fields) { return (follow(step, p, end, fields) && ...); }, value);
+            } else if constexpr (std::is_same_v<V, bool>) {
+                value = lead == 0xc3;
+            } else if constexpr (std::is_same_v<V, Nil>) {
+            } else if constexpr (std::is_integral_v<V>) {
+                if (s.width == 0) {
+                    value = static_cast<V>(static_cast<signed char>(lead));
+                } else if (lead >= 0xd0) {
+                    value = static_cast<V>(static_cast<long long>(load(body, s.width) << (64u - 8u * s.width)) >> (64u - 8u * s.width));
+                } else {
+                    value = static_cast<V>(load(body, s.width));
+                }
+            } else if constexpr (std::is_same_v<V, float> || std::is_same_v<V, double>) {
+                if (s.width == 4) {
+                    auto bits = static_cast<unsigned int>(load(body, 4));
+                    float f = 0;
+                    std::memcpy(&f, &bits, sizeof(f));
+                    value = f;
+                } else {
+                    auto bits = load(body, 8);
+                    double d = 0;
+                    std::memcpy(&d, &bits, sizeof(d));
+                    // A float field takes a float64 only when it is exact, as IStream does
+                    if (std::is_same_v<V, float> && d == d && static_cast<double>(static_cast<float>(d)) != d) {
+                        return false;
+                    }
+                    value = static_cast<V>(d);
+                }
+            } else if constexpr (std::is_same_v<V, std::string> || std::is_same_v<V, std::string_view> ||
+                                 std::is_same_v<V, std::vector<char>>) {
+                size_t size = s.width == 0 ? (lead & 0x1Fu) : static_cast<size_t>(load(body, s.width));
+                body += s.width;
+                if (static_cast<size_t>(end - body) < size) {
+                    return false;
+                }
+                if constexpr (std::is_same_v<V, std::vector<char>>) {
+                    value.assign(body, body + size);
+                } else {
+                    value = V(body, size);
+                }
+                p = body + size;
+                return true;
+            } else {
+                static_assert(sizeof(V) == 0, "LayoutCache does not support this field type");
+            }
+            p = body + s.width;
+            return true;
+        }
+
+    public:
+        // Decodes one message into value and returns the number of bytes it took
+        size_t decode(ConstView data, T & value) {
+            for (size_t i = 0; i != known; ++i) {
+                const Step * step = shapes[i].data();
+                const char * p = data.data;
+                if (follow(step, p, data.data + data.size, value)) {
+                    std::rotate(shapes.begin(), shapes.begin() + i, shapes.begin() + i + 1);
+                    ++hit_count;
+                    return static_cast<size_t>(p - data.data);
+                }
+            }
+
+            ++miss_count;
+            IStream<> is(data);
+            is >> value;
+            size_t used = is.tell();
+            if (known < Shapes) {
+                ++known;
+            }
+            std::rotate(shapes.begin(), shapes.begin() + known - 1, shapes.begin() + known);
+            Shape & shape = shapes[0];
+            shape.clear();
+            IStream<> walk(data);
+            learn<T>(walk, data.data, shape);
+            return used;
+        }
+
+        size_t hits() const {
+            return hit_count;
+        }
+
+        size_t misses() const {
+            return miss_count;
+        }
+    };
+
+}
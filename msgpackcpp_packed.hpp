@@ -0,0 +1,400 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "msgpackcpp.hpp"
+
+namespace msgpackcpp {
+
+    // Extension type code of packed integer sequences
+    inline constexpr signed char packed_ints_ext = 17;
+
+    // Default cap on the decoded count. Runs let a few bytes claim any count, so it is checked before
+    // anything is allocated.
+    inline constexpr size_t packed_max_count = size_t(1) << 24;
+
+    // Integer vector written as a packed_ints_ext extension, or as a plain array when compress is false
+    // (for peers that do not know the extension). Reading accepts both forms, up to max_count values.
+    //
+    // Payload: mode byte, varint count, then
+    //   mode 0: varint zigzag first value, then blocks of up to 128 zigzag deltas, each block a width byte
+    //           followed by the deltas bit-packed little-endian at that width;
+    //   mode 1: runs of (varint zigzag delta from the previous run's value, varint run length).
+    // The writer picks whichever mode is smaller.
+    template <class Vector>
+    struct Packed {
+        Vector & values;
+        bool compress = true;
+        size_t max_count = packed_max_count;
+    };
+
+    template <class T>
+    Packed<std::vector<T>> packed(std::vector<T> & values, bool compress = true, size_t max_count = packed_max_count) {
+        return {values, compress, max_count};
+    }
+
+    template <class T>
+    Packed<const std::vector<T>> packed(const std::vector<T> & values, bool compress = true) {
+        return {values, compress};
+    }
+
+    namespace packed_detail {
+        constexpr size_t block = 128;
+
+        enum Mode : unsigned char {
+            Delta = 0,
+            Runs = 1,
+        };
+
+        inline std::uint64_t zigzag(std::uint64_t v) {
+            return (v << 1u) ^ static_cast<std::uint64_t>(static_cast<std::int64_t>(v) >> 63);
+        }
+
+        inline std::uint64_t unzigzag(std::uint64_t z) {
+            return (z >> 1u) ^ (0 - (z & 1u));
+        }
+
+        inline size_t varint_size(std::uint64_t v) {
+            size_t n = 1;
+            while (v >= 0x80u) {
+                v >>= 7u;
+                ++n;
+            }
+            return n;
+        }
+
+        inline unsigned bit_width(std::uint64_t v) {
+            unsigned w = 0;
+            while (v != 0) {
+                v >>= 1u;
+                ++w;
+            }
+            return w;
+        }
+
+        template <class Sink>
+        void put_varint(Sink & out, std::uint64_t v) {
+            while (v >= 0x80u) {
+                out.push_back(static_cast<char>(v | 0x80u));
+                v >>= 7u;
+            }
+            out.push_back(static_cast<char>(v));
+        }
+
+        class Reader {
+            std::string_view in;
+            size_t pos = 0;
+
+        public:
+            explicit Reader(std::string_view in_) : in(in_) { }
+
+            unsigned char byte() {
+                if (pos == in.size()) {
+                    throw EOFError("Packed payload truncated", 0, 1);
+                }
+                return static_cast<unsigned char>(in[pos++]);
+            }
+
+            std::uint64_t varint() {
+                std::uint64_t v = 0;
+                for (unsigned shift = 0;; shift += 7) {
+                    unsigned char b = byte();
+                    if (shift == 63 && b > 1) {
+                        throw TypeError("Packed varint overflow", b);
+                    }
+                    v |= static_cast<std::uint64_t>(b & 0x7Fu) << shift;
+                    if ((b & 0x80u) == 0) {
+                        return v;
+                    }
+                }
+            }
+
+            // Unpacks a whole block of count values of width bits. Each value is cut out of one unaligned
+            // 64-bit load (plus one byte when it straddles that word), not assembled a byte at a time.
+            void unpack(std::uint64_t * z, size_t count, unsigned width) {
+                size_t bytes = (count * width + 7) / 8;
+                if (in.size() - pos < bytes) {
+                    throw EOFError("Packed payload truncated", in.size() - pos, bytes);
+                }
+                const char * p = in.data() + pos;
+                // Bytes readable from p; words may run past the block into the rest of the payload
+                size_t readable = in.size() - pos;
+                pos += bytes;
+                if (width == 0) {
+                    std::fill(z, z + count, 0);
+                    return;
+                }
+                std::uint64_t mask = width == 64 ? ~std::uint64_t(0) : (std::uint64_t(1) << width) - 1;
+                for (size_t i = 0, bit = 0; i != count; ++i, bit += width) {
+                    size_t at = bit / 8;
+                    unsigned shift = bit % 8;
+                    std::uint64_t word = 0;
+                    if (at + 8 <= readable) {
+                        std::memcpy(&word, p + at, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+                        word = __builtin_bswap64(word);
+#endif
+                    } else {
+                        for (size_t k = bytes - at; k-- != 0;) {
+                            word = (word << 8u) | static_cast<unsigned char>(p[at + k]);
+                        }
+                    }
+                    std::uint64_t v = word >> shift;
+                    if (shift + width > 64) {
+                        v |= static_cast<std::uint64_t>(static_cast<unsigned char>(p[at + 8])) << (64 - shift);
+                    }
+                    z[i] = v & mask;
+                }
+            }
+
+            bool done() const {
+                return pos == in.size();
+            }
+        };
+
+        class Writer {
+            std::vector<char> & out;
+            std::uint64_t bits = 0;
+            unsigned have = 0;
+
+        public:
+            explicit Writer(std::vector<char> & out_) : out(out_) { }
+
+            void put(std::uint64_t v, unsigned n) {
+                bits |= v << have;
+                have += n;
+                while (have >= 8) {
+                    out.push_back(static_cast<char>(bits));
+                    bits >>= 8u;
+                    have -= 8;
+                }
+            }
+
+            void flush() {
+                if (have != 0) {
+                    out.push_back(static_cast<char>(bits));
+                }
+                bits = 0;
+                have = 0;
+            }
+        };
+
+        // Turns zigzag deltas into values: out[i] = prev + sum of deltas up to i.
+        // The running sum is the serial part of decoding; SSE2 does it two lanes at a time. Unpacking the
+        // deltas before it stays scalar, one word load per value.
+        inline std::uint64_t prefix_sum(const std::uint64_t * z, std::uint64_t * out, size_t n, std::uint64_t prev) {
+            size_t i = 0;
+#if defined(__SSE2__)
+            const __m128i one = _mm_set1_epi64x(1);
+            const __m128i zero = _mm_setzero_si128();
+            __m128i carry = _mm_set1_epi64x(static_cast<long long>(prev));
+            for (; i + 2 <= n; i += 2) {
+                __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i *>(z + i));
+                __m128i d = _mm_xor_si128(_mm_srli_epi64(v, 1), _mm_sub_epi64(zero, _mm_and_si128(v, one)));
+                d = _mm_add_epi64(d, _mm_slli_si128(d, 8));
+                d = _mm_add_epi64(d, carry);
+                _mm_storeu_si128(reinterpret_cast<__m128i *>(out + i), d);
+                carry = _mm_shuffle_epi32(d, _MM_SHUFFLE(3, 2, 3, 2));
+            }
+            if (i != 0) {
+                prev = out[i - 1];
+            }
+#endif
+            for (; i != n; ++i) {
+                prev += unzigzag(z[i]);
+                out[i] = prev;
+            }
+            return prev;
+        }
+
+        template <class T>
+        void encode(const std::vector<T> & values, std::vector<char> & payload) {
+            size_t n = values.size();
+            auto raw = [&values](size_t i) {
+                return static_cast<std::uint64_t>(values[i]);
+            };
+
+            size_t delta_size = 1 + varint_size(n);
+            size_t runs_size = delta_size;
+            if (n != 0) {
+                delta_size += varint_size(zigzag(raw(0)));
+                for (size_t b = 1; b < n; b += block) {
+                    size_t count = std::min(block, n - b);
+                    std::uint64_t all = 0;
+                    for (size_t i = b; i != b + count; ++i) {
+                        all |= zigzag(raw(i) - raw(i - 1));
+                    }
+                    delta_size += 1 + (count * bit_width(all) + 7) / 8;
+                }
+                std::uint64_t prev = 0;
+                for (size_t i = 0; i != n;) {
+                    size_t j = i + 1;
+                    while (j != n && values[j] == values[i]) {
+                        ++j;
+                    }
+                    runs_size += varint_size(zigzag(raw(i) - prev)) + varint_size(j - i);
+                    prev = raw(i);
+                    i = j;
+                }
+            }
+
+            if (runs_size < delta_size) {
+                payload.push_back(static_cast<char>(Runs));
+                put_varint(payload, n);
+                std::uint64_t prev = 0;
+                for (size_t i = 0; i != n;) {
+                    size_t j = i + 1;
+                    while (j != n && values[j] == values[i]) {
+                        ++j;
+                    }
+                    put_varint(payload, zigzag(raw(i) - prev));
+                    put_varint(payload, j - i);
+                    prev = raw(i);
+                    i = j;
+                }
+                return;
+            }
+
+            payload.push_back(static_cast<char>(Delta));
+            put_varint(payload, n);
+            if (n == 0) {
+                return;
+            }
+            put_varint(payload, zigzag(raw(0)));
+            Writer bits(payload);
+            for (size_t b = 1; b < n; b += block) {
+                size_t count = std::min(block, n - b);
+                std::uint64_t all = 0;
+                for (size_t i = b; i != b + count; ++i) {
+                    all |= zigzag(raw(i) - raw(i - 1));
+                }
+                unsigned width = bit_width(all);
+                payload.push_back(static_cast<unsigned char>(width));
+                for (size_t i = b; i != b + count; ++i) {
+                    std::uint64_t z = zigzag(raw(i) - raw(i - 1));
+                    if (width > 32) {
+                        bits.put(z & 0xFFFFFFFFu, 32);
+                        bits.put(z >> 32u, width - 32);
+                    } else {
+                        bits.put(z, width);
+                    }
+                }
+                bits.flush();
+            }
+        }
+
+        // Reports e to the stream's policy, as IStream's own errors are, then throws it
+        template <class Policy, class E>
+        [[noreturn, gnu::cold, gnu::noinline]] void fail(IStream<Policy> & is, const E & e) {
+            is.policy().on_error(e);
+            throw e;
+        }
+
+        template <class T, class Policy>
+        void decode(IStream<Policy> & is, std::string_view payload, std::vector<T> & values, size_t max_count) {
+            Reader in(payload);
+            auto mode = in.byte();
+            std::uint64_t n = in.varint();
+            // The smallest possible encoding bounds the count, so a forged one cannot force a huge reserve
+            if (mode == Delta && n > 1 + block * payload.size()) {
+                fail(is, LengthError("Packed count exceeds payload", n, 1 + block * payload.size()));
+            }
+            if (n > max_count) {
+                fail(is, LimitError("Packed count exceeds limit", n, max_count));
+            }
+            if (n > std::numeric_limits<size_t>::max() / sizeof(T)) {
+                fail(is, LimitError("Packed count overflows", n, std::numeric_limits<size_t>::max() / sizeof(T)));
+            }
+            is.policy().on_container(n);
+            is.policy().on_allocation(n * sizeof(T));
+            values.clear();
+
+            if (mode == Runs) {
+                std::uint64_t prev = 0;
+                while (values.size() != n) {
+                    prev += unzigzag(in.varint());
+                    std::uint64_t run = in.varint();
+                    if (run == 0 || run > n - values.size()) {
+                        fail(is, LengthError("Packed run exceeds count", run, n - values.size()));
+                    }
+                    values.insert(values.end(), run, static_cast<T>(prev));
+                }
+            } else if (mode == Delta) {
+                values.reserve(n);
+                if (n != 0) {
+                    std::uint64_t prev = unzigzag(in.varint());
+                    values.push_back(static_cast<T>(prev));
+                    std::uint64_t z[block];
+                    std::uint64_t out[block];
+                    for (size_t b = 1; b < n; b += block) {
+                        size_t count = std::min<size_t>(block, n - b);
+                        unsigned width = in.byte();
+                        if (width > 64) {
+                            fail(is, TypeError("Packed width out of range", static_cast<unsigned char>(width)));
+                        }
+                        in.unpack(z, count, width);
+                        prev = prefix_sum(z, out, count, prev);
+                        for (size_t i = 0; i != count; ++i) {
+                            values.push_back(static_cast<T>(out[i]));
+                        }
+                    }
+                }
+            } else {
+                fail(is, TypeError("Unknown packed mode", mode));
+            }
+            if (!in.done()) {
+                fail(is, LengthError("Trailing bytes in packed payload", payload.size(), payload.size()));
+            }
+        }
+    }
+
+    template <class Stream, class Vector>
+    void msgpack_pack(Stream & os, const Packed<Vector> & p) {
+        using T = typename std::remove_const_t<Vector>::value_type;
+        static_assert(std::is_integral_v<T> && !std::is_same_v<T, bool>, "Packed holds integer vectors");
+        if (!p.compress) {
+            os.write_array_header(p.values.size());
+            for (T v : p.values) {
+                os << v;
+            }
+            return;
+        }
+        auto payload = BufferPool::local().acquire(p.values.size() + 16);
+        packed_detail::encode(p.values, payload.vector());
+        os.write_ext(packed_ints_ext, std::string_view(payload.data(), payload.size()));
+    }
+
+    template <class Policy, class T>
+    void msgpack_unpack(IStream<Policy> & is, Packed<std::vector<T>> & p) {
+        static_assert(std::is_integral_v<T> && !std::is_same_v<T, bool>, "Packed holds integer vectors");
+        unsigned char c = is.peek();
+        if ((c & 0xF0u) == 0x90u || c == 0xdc || c == 0xdd) {
+            size_t size = is.read_array_header();
+            if (size > p.max_count) {
+                packed_detail::fail(is, LimitError("Packed count exceeds limit", size, p.max_count));
+            }
+            p.values.clear();
+            for (size_t i = 0; i != size; ++i) {
+                is >> p.values.emplace_back();
+            }
+            return;
+        }
+        signed char type = 0;
+        std::string_view payload = is.read_ext(type);
+        if (type != packed_ints_ext) {
+            packed_detail::fail(is, TypeError("Expected packed integers", static_cast<unsigned char>(type)));
+        }
+        packed_detail::decode(is, payload, p.values, p.max_count);
+    }
+
+}
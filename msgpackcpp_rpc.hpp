@@ -0,0 +1,326 @@
+#pragma once
+
+#include <functional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include <sys/socket.h>
+
+#include "msgpackcpp_async.hpp"
+
+namespace msgpackcpp {
+
+    class RpcError : public std::runtime_error {
+    public:
+        explicit RpcError(const std::string & msg_) : std::runtime_error(msg_) { }
+    };
+
+    // msgpack-rpc endpoint over one connection. Calls are pipelined: each is encoded as soon as it is made
+    // and matched back by msgid. Everything queued during one loop tick goes out in a single write.
+    // The connection must outlive the loop run it is used in. A failed send or a malformed message from
+    // the peer closes this connection only: its outstanding calls fail with RpcError and serve() returns.
+    class RpcConnection {
+        enum MessageType : unsigned int {
+            Request = 0,
+            Response = 1,
+            Notification = 2,
+        };
+
+        struct Pending {
+            std::coroutine_handle<> waiter;
+            std::optional<ConstView> response;
+            std::vector<char> stored;
+            bool done = false;
+        };
+
+        struct NameHash {
+            using is_transparent = void;
+
+            size_t operator()(std::string_view s) const noexcept {
+                return std::hash<std::string_view>{}(s);
+            }
+        };
+
+        using Handler = std::function<void(RpcConnection &, IStream<> &, std::optional<unsigned int>)>;
+
+        EventLoop & loop;
+        int fd;
+        AsyncReader reader;
+        std::vector<char> out;
+        size_t sent = 0;
+        bool flush_scheduled = false;
+        bool draining = false;
+        bool closed = false;
+        // Why the connection closed; outstanding calls fail with it
+        std::string close_reason = "Connection closed";
+        size_t writes = 0;
+        unsigned int next_id = 0;
+        std::unordered_map<unsigned int, Pending> pending;
+        std::unordered_map<std::string, Handler, NameHash, std::equal_to<>> handlers;
+
+        struct PendingAwaiter {
+            Pending & p;
+
+            bool await_ready() const noexcept {
+                return p.done;
+            }
+
+            void await_suspend(std::coroutine_handle<> h) noexcept {
+                p.waiter = h;
+            }
+
+            void await_resume() const noexcept { }
+        };
+
+        template <typename T>
+        void queue(const T & message) {
+            if (closed) {
+                return;
+            }
+            OStream os(out);
+            os << message;
+            if (!flush_scheduled) {
+                flush_scheduled = true;
+                loop.defer([this] {
+                    flush_scheduled = false;
+                    flush();
+                });
+            }
+        }
+
+        bool write_some() {
+            while (sent != out.size()) {
+                ssize_t n = ::send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+                ++writes;
+                if (n >= 0) {
+                    sent += static_cast<size_t>(n);
+                } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return false;
+                } else if (errno != EINTR) {
+                    close(std::system_error(errno, std::generic_category(), "send").what());
+                    return true;
+                }
+            }
+            out.clear();
+            sent = 0;
+            return true;
+        }
+
+        // Closes the connection after an error. Shutting the socket down wakes serve() and a pending drain,
+        // and every outstanding call fails with reason.
+        void close(const std::string & reason) {
+            if (closed) {
+                return;
+            }
+            closed = true;
+            close_reason = "Connection closed: " + reason;
+            out.clear();
+            sent = 0;
+            ::shutdown(fd, SHUT_RDWR);
+            fail_pending();
+        }
+
+        void fail_pending() {
+            for (auto & [id, p] : pending) {
+                p.done = true;
+                if (p.waiter) {
+                    loop.post(std::exchange(p.waiter, nullptr));
+                }
+            }
+        }
+
+        void flush() {
+            if (draining || closed) {
+                return;
+            }
+            if (!write_some()) {
+                draining = true;
+                loop.spawn(drain());
+            }
+        }
+
+        Task<void> drain() {
+            do {
+                co_await loop.writable(fd);
+            } while (!closed && !write_some());
+            draining = false;
+        }
+
+        // Erases a call's pending entry on every way out: a result, an error, or the task being dropped.
+        // As a coroutine parameter it lives in the frame, so even a task that never ran cleans up.
+        class PendingGuard {
+            RpcConnection * self;
+
+        public:
+            const unsigned int id;
+
+            PendingGuard(RpcConnection * self_, unsigned int id_) : self(self_), id(id_) { }
+
+            PendingGuard(PendingGuard && other) noexcept : self(std::exchange(other.self, nullptr)), id(other.id) { }
+
+            PendingGuard & operator=(PendingGuard &&) = delete;
+
+            ~PendingGuard() {
+                if (self != nullptr) {
+                    self->pending.erase(id);
+                }
+            }
+        };
+
+        template <typename R>
+        Task<R> await_response(PendingGuard frame_guard) {
+            // Moved into a local so the entry goes when the body ends, not when the task is destroyed
+            PendingGuard guard = std::move(frame_guard);
+            auto & p = pending[guard.id];
+            co_await PendingAwaiter{p};
+            if (!p.response && p.stored.empty()) {
+                throw RpcError(close_reason);
+            }
+            ConstView view = p.response ? *p.response : ConstView(p.stored.data(), p.stored.size());
+            IStream is(view);
+            if (*view.data != '\xc0') {
+                std::string_view error = "Remote error";
+                if (auto c = static_cast<unsigned char>(*view.data); (c & 0xE0u) == 0xA0u || (c >= 0xd9 && c <= 0xdb)) {
+                    is >> error;
+                }
+                throw RpcError(std::string(error));
+            }
+            Nil nil;
+            is >> nil;
+            if constexpr (!std::is_void_v<R>) {
+                R result{};
+                is >> result;
+                co_return result;
+            } else {
+                is.skip();
+            }
+        }
+
+        void dispatch(ConstView message) {
+            IStream is(message);
+            size_t size = is.read_array_header();
+            unsigned int type = 0;
+            is >> type;
+            if (type == Response && size == 4) {
+                unsigned int id = 0;
+                is >> id;
+                auto it = pending.find(id);
+                if (it == pending.end()) {
+                    return;
+                }
+                auto & p = it->second;
+                p.done = true;
+                ConstView rest(message.data + is.tell(), message.size - is.tell());
+                if (p.waiter) {
+                    // Resumed inline so the caller decodes straight from the receive buffer
+                    p.response.emplace(rest);
+                    std::exchange(p.waiter, nullptr).resume();
+                } else {
+                    p.stored.assign(rest.data, rest.data + rest.size);
+                }
+            } else if ((type == Request && size == 4) || (type == Notification && size == 3)) {
+                std::optional<unsigned int> id;
+                if (type == Request) {
+                    is >> id.emplace();
+                }
+                std::string_view method;
+                is >> method;
+                auto it = handlers.find(method);
+                if (it == handlers.end()) {
+                    if (id) {
+                        queue(std::make_tuple(static_cast<unsigned int>(Response), *id, std::string("Unknown method"), Nil{}));
+                    }
+                    return;
+                }
+                try {
+                    it->second(*this, is, id);
+                } catch (const std::exception & e) {
+                    if (id) {
+                        queue(std::make_tuple(static_cast<unsigned int>(Response), *id, std::string(e.what()), Nil{}));
+                    }
+                }
+            } else {
+                throw TypeError("Bad rpc message", static_cast<unsigned char>(type));
+            }
+        }
+
+    public:
+        RpcConnection(EventLoop & loop_, int fd_) : loop(loop_), fd(fd_), reader(loop_, fd_) { }
+
+        RpcConnection(const RpcConnection &) = delete;
+        RpcConnection & operator=(const RpcConnection &) = delete;
+
+        // Out of line: it tears down both maps and the reader, too much to copy into every unwinding path
+        [[gnu::noinline]] ~RpcConnection() = default;
+
+        // The request is encoded immediately; awaiting the task yields the result or throws RpcError
+        template <typename R, typename... Args>
+        Task<R> call(std::string_view method, const Args &... params) {
+            unsigned int id = next_id++;
+            pending[id].done = closed;
+            PendingGuard guard(this, id);
+            queue(std::make_tuple(static_cast<unsigned int>(Request), id, method, std::tie(params...)));
+            return await_response<R>(std::move(guard));
+        }
+
+        template <typename... Args>
+        void notify(std::string_view method, const Args &... params) {
+            queue(std::make_tuple(static_cast<unsigned int>(Notification), method, std::tie(params...)));
+        }
+
+        // Registers handler for method; it receives the decoded Params tuple's elements as arguments
+        template <typename Params, typename F>
+        void on(std::string method, F handler) {
+            handlers[std::move(method)] = [handler = std::move(handler)](RpcConnection & self, IStream<> & is, std::optional<unsigned int> id) {
+                Params params;
+                is >> params;
+                using R = decltype(std::apply(handler, params));
+                if constexpr (std::is_void_v<R>) {
+                    std::apply(handler, params);
+                    if (id) {
+                        self.queue(std::make_tuple(static_cast<unsigned int>(Response), *id, Nil{}, Nil{}));
+                    }
+                } else {
+                    R result = std::apply(handler, params);
+                    if (id) {
+                        self.queue(std::make_tuple(static_cast<unsigned int>(Response), *id, Nil{}, result));
+                    }
+                }
+            };
+        }
+
+        // Reads and dispatches messages until the peer closes or the connection fails; outstanding calls
+        // then fail. Errors end this connection only and are not rethrown. On return the fd is forgotten by
+        // the loop and may be closed.
+        Task<void> serve() {
+            try {
+                while (!closed) {
+                    if (auto size = reader.buffered_message()) {
+                        ConstView message(reader.pending().data, *size);
+                        dispatch(message);
+                        reader.consume(*size);
+                    } else if (!co_await reader.fill()) {
+                        closed = true;
+                    }
+                }
+            } catch (const std::exception & e) {
+                close(e.what());
+            }
+            fail_pending();
+            loop.forget(fd);
+        }
+
+        // Number of write syscalls issued so far
+        size_t write_calls() const {
+            return writes;
+        }
+
+        // Calls whose tasks still wait for, or hold, a response
+        size_t outstanding_calls() const {
+            return pending.size();
+        }
+    };
+
+}
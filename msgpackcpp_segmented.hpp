@@ -0,0 +1,283 @@
+#pragma once
+
+#include <cstring>
+#include <deque>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "msgpackcpp.hpp"
+
+namespace msgpackcpp {
+
+    // Encoded data split over several pieces, e.g. consecutive receive buffers or the two halves of a
+    // wrapped ring. The pieces are not owned and must outlive every stream over them.
+    class SegmentedView {
+        std::vector<ConstView> pieces;
+
+    public:
+        SegmentedView() = default;
+
+        SegmentedView(std::initializer_list<ConstView> pieces_) {
+            for (auto & p : pieces_) {
+                add(p);
+            }
+        }
+
+        SegmentedView & add(ConstView piece) {
+            if (piece.size != 0) {
+                pieces.push_back(piece);
+            }
+            return *this;
+        }
+
+        size_t count() const {
+            return pieces.size();
+        }
+
+        const ConstView & operator[](size_t i) const {
+            return pieces[i];
+        }
+
+        size_t size() const {
+            size_t total = 0;
+            for (auto & p : pieces) {
+                total += p.size;
+            }
+            return total;
+        }
+    };
+
+    // Decoder over a SegmentedView with the IStream interface. A value that lies inside one segment is
+    // decoded in place by an IStream; only a value that straddles a boundary is copied out and stitched.
+    // Views of stitched strings point into buffers owned by the stream, so they live as long as it does.
+    class SegmentedIStream {
+        template <class T>
+        struct is_tuple : std::false_type { };
+
+        template <class... Args>
+        struct is_tuple<std::tuple<Args...>> : std::true_type { };
+
+        const SegmentedView & view;
+        size_t segment = 0;
+        size_t offset = 0;
+        size_t consumed = 0;
+        size_t total;
+        size_t stitched_total = 0;
+        std::vector<char> scratch;
+        std::deque<std::vector<char>> kept;
+
+        size_t left_in_segment() const {
+            return segment == view.count() ? 0 : view[segment].size - offset;
+        }
+
+        void advance(size_t n) {
+            consumed += n;
+            while (n != 0) {
+                size_t step = std::min(n, left_in_segment());
+                offset += step;
+                n -= step;
+                if (offset == view[segment].size) {
+                    ++segment;
+                    offset = 0;
+                }
+            }
+        }
+
+        // Copies n bytes starting at the read position without consuming them
+        void peek_bytes(char * out, size_t n) const {
+            size_t s = segment;
+            size_t o = offset;
+            while (n != 0) {
+                size_t step = std::min(n, view[s].size - o);
+                std::memcpy(out, view[s].data + o, step);
+                out += step;
+                n -= step;
+                ++s;
+                o = 0;
+            }
+        }
+
+        [[noreturn]] void eof(size_t needed) const {
+            throw EOFError("EOF", total - consumed, needed);
+        }
+
+        // Length of the value starting with header (of which available bytes are present), or only of
+        // its header when it is an array or a map
+        static size_t value_size(const char * header, size_t available) {
+            auto c = static_cast<unsigned char>(header[0]);
+            auto length = [&](size_t bytes) {
+                if (available < 1 + bytes) {
+                    return std::numeric_limits<size_t>::max();
+                }
+                size_t n = 0;
+                for (size_t i = 1; i <= bytes; ++i) {
+                    n = (n << 8u) | static_cast<unsigned char>(header[i]);
+                }
+                return n;
+            };
+            auto add = [](size_t base, size_t n) {
+                return n == std::numeric_limits<size_t>::max() ? n : base + n;
+            };
+            switch (c) {
+                case 0xc1:
+                    throw TypeError("Unknown type", c);
+                case 0xcc: case 0xd0:
+                    return 2;
+                case 0xcd: case 0xd1: case 0xdc: case 0xde:
+                    return 3;
+                case 0xca: case 0xce: case 0xd2: case 0xdd: case 0xdf:
+                    return 5;
+                case 0xcb: case 0xcf: case 0xd3:
+                    return 9;
+                case 0xc4: case 0xd9:
+                    return add(2, length(1));
+                case 0xc5: case 0xda:
+                    return add(3, length(2));
+                case 0xc6: case 0xdb:
+                    return add(5, length(4));
+                case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8:
+                    return 2 + (size_t(1) << (c - 0xd4u));
+                case 0xc7:
+                    return add(3, length(1));
+                case 0xc8:
+                    return add(4, length(2));
+                case 0xc9:
+                    return add(6, length(4));
+                default:
+                    return (c & 0xE0u) == 0xA0u ? 1 + (c & 0x1Fu) : 1;
+            }
+        }
+
+        size_t next_size() const {
+            if (consumed == total) {
+                eof(1);
+            }
+            char header[6];
+            size_t available = std::min(sizeof(header), total - consumed);
+            peek_bytes(header, available);
+            size_t size = value_size(header, available);
+            if (size > total - consumed) {
+                eof(size);
+            }
+            return size;
+        }
+
+        // Runs op on an IStream over the current segment when the value ends inside it, otherwise over a
+        // stitched copy of exactly that value
+        template <class Op>
+        decltype(auto) decode(Op && op, bool keep = false) {
+            size_t size = next_size();
+            if (size <= left_in_segment()) {
+                IStream<> is(ConstView(view[segment].data + offset, left_in_segment()));
+                if constexpr (std::is_void_v<decltype(op(is))>) {
+                    op(is);
+                    advance(is.tell());
+                    return;
+                } else {
+                    decltype(auto) result = op(is);
+                    advance(is.tell());
+                    return result;
+                }
+            }
+            std::vector<char> & buf = keep ? kept.emplace_back(size) : scratch;
+            buf.resize(size);
+            peek_bytes(buf.data(), size);
+            stitched_total += size;
+            IStream<> is(ConstView(buf.data(), size));
+            advance(size);
+            return op(is);
+        }
+
+        template <typename Tuple, size_t... I>
+        void read_tuple(Tuple & tuple, std::index_sequence<I...>) {
+            size_t size = read_array_header();
+            if (size != sizeof...(I)) {
+                throw LengthError("Bad tuple size", size, sizeof...(I));
+            }
+            (*this >> ... >> std::get<I>(tuple));
+        }
+
+    public:
+        explicit SegmentedIStream(const SegmentedView & view_) : view(view_), total(view_.size()) { }
+
+        SegmentedIStream(const SegmentedIStream &) = delete;
+        SegmentedIStream & operator=(const SegmentedIStream &) = delete;
+
+        // Kept out of line, since freeing the stitched copies is not worth inlining into each caller
+        [[gnu::noinline]] ~SegmentedIStream() = default;
+
+        template <typename T, std::enable_if_t<!is_tuple<T>::value && !has_msgpack_unpack<SegmentedIStream, T>::value, int> = 0>
+        SegmentedIStream & operator>>(T & value) {
+            decode([&value](IStream<> & is) { is >> value; }, std::is_same_v<T, std::string_view>);
+            return *this;
+        }
+
+        template <typename... Args>
+        SegmentedIStream & operator>>(std::tuple<Args&...> tuple) {
+            read_tuple(tuple, std::index_sequence_for<Args...>{});
+            return *this;
+        }
+
+        template <typename... Args>
+        SegmentedIStream & operator>>(std::tuple<Args...> & tuple) {
+            read_tuple(tuple, std::index_sequence_for<Args...>{});
+            return *this;
+        }
+
+        template <typename T, std::enable_if_t<has_msgpack_unpack<SegmentedIStream, std::remove_reference_t<T>>::value, int> = 0>
+        SegmentedIStream & operator>>(T && value) {
+            msgpack_unpack(*this, value);
+            return *this;
+        }
+
+        size_t read_array_header() {
+            return decode([](IStream<> & is) { return is.read_array_header(); });
+        }
+
+        size_t read_map_header() {
+            return decode([](IStream<> & is) { return is.read_map_header(); });
+        }
+
+        std::string_view read_ext(signed char & type) {
+            return decode([&type](IStream<> & is) { return is.read_ext(type); }, true);
+        }
+
+        unsigned char peek() const {
+            if (consumed == total) {
+                eof(1);
+            }
+            return static_cast<unsigned char>(view[segment].data[offset]);
+        }
+
+        // Skips one complete value; nothing is copied, even across segments
+        SegmentedIStream & skip() {
+            size_t pending = 1;
+            while (pending != 0) {
+                --pending;
+                auto c = peek();
+                if ((c & 0xF0u) == 0x90u || c == 0xdc || c == 0xdd) {
+                    pending += read_array_header();
+                } else if ((c & 0xF0u) == 0x80u || c == 0xde || c == 0xdf) {
+                    pending += 2 * read_map_header();
+                } else {
+                    advance(next_size());
+                }
+            }
+            return *this;
+        }
+
+        // Number of bytes consumed so far, counted across all segments
+        size_t tell() const {
+            return consumed;
+        }
+
+        // Number of bytes copied to decode values that straddled a segment boundary
+        size_t stitched_bytes() const {
+            return stitched_total;
+        }
+    };
+
+}
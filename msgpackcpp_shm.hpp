@@ -0,0 +1,351 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <new>
+#include <optional>
+#include <stdexcept>
+#include <system_error>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "msgpackcpp.hpp"
+
+namespace msgpackcpp {
+
+    // Owns a shared mapping backed by a memfd or a POSIX shm object
+    class SharedMemory {
+        int fd = -1;
+        void * ptr = nullptr;
+        size_t length = 0;
+
+        SharedMemory(int fd_, size_t length_) : fd(fd_), length(length_) {
+            ptr = ::mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                int err = errno;
+                ::close(fd);
+                throw std::system_error(err, std::generic_category(), "mmap");
+            }
+        }
+
+        static SharedMemory resize(int fd, size_t length) {
+            if (::ftruncate(fd, static_cast<off_t>(length)) != 0) {
+                int err = errno;
+                ::close(fd);
+                throw std::system_error(err, std::generic_category(), "ftruncate");
+            }
+            return SharedMemory(fd, length);
+        }
+
+    public:
+        SharedMemory(SharedMemory && other) noexcept
+            : fd(std::exchange(other.fd, -1)), ptr(std::exchange(other.ptr, nullptr)), length(std::exchange(other.length, 0)) { }
+
+        SharedMemory & operator=(SharedMemory && other) noexcept {
+            std::swap(fd, other.fd);
+            std::swap(ptr, other.ptr);
+            std::swap(length, other.length);
+            return *this;
+        }
+
+        ~SharedMemory() {
+            if (ptr != nullptr) {
+                ::munmap(ptr, length);
+            }
+            if (fd != -1) {
+                ::close(fd);
+            }
+        }
+
+        // Anonymous memory; share it by fork or by passing the fd over a unix socket
+        static SharedMemory create_memfd(const char * name, size_t length) {
+            int fd = ::memfd_create(name, MFD_CLOEXEC);
+            if (fd == -1) {
+                throw std::system_error(errno, std::generic_category(), "memfd_create");
+            }
+            return resize(fd, length);
+        }
+
+        static SharedMemory create_shm(const char * name, size_t length) {
+            int fd = ::shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0600);
+            if (fd == -1) {
+                throw std::system_error(errno, std::generic_category(), "shm_open");
+            }
+            return resize(fd, length);
+        }
+
+        static SharedMemory open_shm(const char * name) {
+            int fd = ::shm_open(name, O_RDWR, 0);
+            if (fd == -1) {
+                throw std::system_error(errno, std::generic_category(), "shm_open");
+            }
+            return from_fd(fd);
+        }
+
+        // Takes ownership of fd and maps all of it
+        static SharedMemory from_fd(int fd) {
+            struct stat st{};
+            if (::fstat(fd, &st) != 0) {
+                int err = errno;
+                ::close(fd);
+                throw std::system_error(err, std::generic_category(), "fstat");
+            }
+            return SharedMemory(fd, static_cast<size_t>(st.st_size));
+        }
+
+        static void unlink_shm(const char * name) {
+            ::shm_unlink(name);
+        }
+
+        void * data() const {
+            return ptr;
+        }
+
+        size_t size() const {
+            return length;
+        }
+
+        int handle() const {
+            return fd;
+        }
+    };
+
+    // Fixed-capacity ring of fixed-size message slots placed in (shared) memory.
+    // Producers encode straight into a reserved slot, consumers decode committed slots in place.
+    // Slots carry a sequence number (bounded MPMC queue scheme), so the multi-producer variant
+    // only adds a CAS on the head cursor.
+    template <bool MultiProducer>
+    class MessageRing {
+        static constexpr size_t cache_line = 64;
+        static constexpr std::uint64_t magic = 0x6d7367706b72696eull;
+        static constexpr std::uint32_t aborted = 0xFFFFFFFFu;
+
+        static_assert(std::atomic<std::uint64_t>::is_always_lock_free);
+
+        struct alignas(cache_line) Header {
+            std::uint64_t magic;
+            std::uint64_t slot_count;
+            std::uint64_t slot_size;
+        };
+
+        struct alignas(cache_line) Cursor {
+            std::atomic<std::uint64_t> value;
+        };
+
+        struct alignas(cache_line) Slot {
+            std::atomic<std::uint64_t> sequence;
+            std::uint32_t length;
+        };
+
+        Header * header = nullptr;
+        Cursor * head = nullptr;
+        Cursor * tail = nullptr;
+        char * slots = nullptr;
+        size_t stride = 0;
+
+        static constexpr size_t slot_stride(size_t slot_size) {
+            return (sizeof(Slot) + slot_size + cache_line - 1) / cache_line * cache_line;
+        }
+
+        MessageRing(void * memory, size_t slot_size)
+            : header(static_cast<Header *>(memory)),
+              head(reinterpret_cast<Cursor *>(static_cast<char *>(memory) + sizeof(Header))),
+              tail(reinterpret_cast<Cursor *>(static_cast<char *>(memory) + sizeof(Header) + sizeof(Cursor))),
+              slots(static_cast<char *>(memory) + sizeof(Header) + 2 * sizeof(Cursor)),
+              stride(slot_stride(slot_size)) { }
+
+        Slot * slot(std::uint64_t pos) const {
+            return reinterpret_cast<Slot *>(slots + (pos & (header->slot_count - 1)) * stride);
+        }
+
+        static char * payload(Slot * s) {
+            return reinterpret_cast<char *>(s) + sizeof(Slot);
+        }
+
+    public:
+        class Reservation {
+            friend class MessageRing;
+
+            MessageRing * ring;
+            Slot * target;
+            std::uint64_t pos;
+            MutableView mv;
+
+            Reservation(MessageRing * ring_, Slot * target_, std::uint64_t pos_)
+                : ring(ring_), target(target_), pos(pos_), mv(payload(target_), ring_->header->slot_size) { }
+
+            void publish(std::uint32_t length) {
+                target->length = length;
+                target->sequence.store(pos + 1, std::memory_order_release);
+                ring = nullptr;
+            }
+
+        public:
+            Reservation(Reservation && other) noexcept
+                : ring(std::exchange(other.ring, nullptr)), target(other.target), pos(other.pos), mv(other.mv) { }
+
+            Reservation & operator=(Reservation &&) = delete;
+
+            // An abandoned slot is still published so the ring never stalls; consumers skip it
+            ~Reservation() {
+                if (ring != nullptr) {
+                    publish(aborted);
+                }
+            }
+
+            MutableView & view() {
+                return mv;
+            }
+
+            // Publishes everything written through view()
+            void commit() {
+                publish(static_cast<std::uint32_t>(mv.cur - mv.data));
+            }
+        };
+
+        class Message {
+            friend class MessageRing;
+
+            MessageRing * ring;
+            Slot * source;
+            std::uint64_t pos;
+            ConstView cv;
+
+            Message(MessageRing * ring_, Slot * source_, std::uint64_t pos_)
+                : ring(ring_), source(source_), pos(pos_), cv(payload(source_), source_->length) { }
+
+        public:
+            Message(Message && other) noexcept
+                : ring(std::exchange(other.ring, nullptr)), source(other.source), pos(other.pos), cv(other.cv) { }
+
+            Message & operator=(Message &&) = delete;
+
+            ~Message() {
+                release();
+            }
+
+            ConstView view() const {
+                return cv;
+            }
+
+            // Hands the slot back to producers; the view must not be used afterwards
+            void release() {
+                if (ring != nullptr) {
+                    ring->release_slot(source, pos);
+                    ring = nullptr;
+                }
+            }
+        };
+
+        static size_t required_size(size_t slot_count, size_t slot_size) {
+            return sizeof(Header) + 2 * sizeof(Cursor) + slot_count * slot_stride(slot_size);
+        }
+
+        // Whether a ring of this shape is valid and fits in memory_size; safe against forged header fields
+        static bool fits(size_t memory_size, size_t slot_count, size_t slot_size) {
+            constexpr size_t fixed = sizeof(Header) + 2 * sizeof(Cursor);
+            if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0 || slot_size >= aborted || memory_size < fixed) {
+                return false;
+            }
+            return slot_count <= (memory_size - fixed) / slot_stride(slot_size);
+        }
+
+        // Lays out an empty ring in memory, which must be cache-line aligned (mmap is)
+        static MessageRing create(void * memory, size_t memory_size, size_t slot_count, size_t slot_size) {
+            if (slot_count == 0 || (slot_count & (slot_count - 1)) != 0) {
+                throw std::invalid_argument("Slot count must be a power of two");
+            }
+            if (!fits(memory_size, slot_count, slot_size)) {
+                throw std::invalid_argument("Not enough memory for ring");
+            }
+            auto * h = new (memory) Header{0, slot_count, slot_size};
+            MessageRing ring(memory, slot_size);
+            new (ring.head) Cursor{{0}};
+            new (ring.tail) Cursor{{0}};
+            for (size_t i = 0; i != slot_count; ++i) {
+                new (ring.slot(i)) Slot{{i}, 0};
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            h->magic = magic;
+            return ring;
+        }
+
+        static MessageRing attach(void * memory, size_t memory_size) {
+            auto * h = static_cast<Header *>(memory);
+            if (memory_size < sizeof(Header) || h->magic != magic) {
+                throw std::invalid_argument("Memory does not hold a message ring");
+            }
+            // Pairs with the release fence in create(), so the fields below are the ones written before magic
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (!fits(memory_size, h->slot_count, h->slot_size)) {
+                throw std::invalid_argument("Message ring header does not match its memory");
+            }
+            return MessageRing(memory, h->slot_size);
+        }
+
+        size_t slot_size() const {
+            return header->slot_size;
+        }
+
+        size_t capacity() const {
+            return header->slot_count;
+        }
+
+        // Claims the next free slot, or nothing if the ring is full
+        std::optional<Reservation> try_reserve() {
+            std::uint64_t pos = head->value.load(std::memory_order_relaxed);
+            for (;;) {
+                Slot * s = slot(pos);
+                std::uint64_t seq = s->sequence.load(std::memory_order_acquire);
+                auto diff = static_cast<std::int64_t>(seq - pos);
+                if (diff < 0) {
+                    return std::nullopt;
+                }
+                if (diff > 0) {
+                    pos = head->value.load(std::memory_order_relaxed);
+                    continue;
+                }
+                if constexpr (MultiProducer) {
+                    if (!head->value.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                        continue;
+                    }
+                } else {
+                    head->value.store(pos + 1, std::memory_order_relaxed);
+                }
+                return Reservation(this, s, pos);
+            }
+        }
+
+        // Next committed message, or nothing if the ring is empty. Single consumer only.
+        // The consumer cursor moves on here rather than on release, so several messages can be held
+        // at once and released in any order; producers wait only for the slot they are about to reuse.
+        std::optional<Message> try_consume() {
+            for (;;) {
+                std::uint64_t pos = tail->value.load(std::memory_order_relaxed);
+                Slot * s = slot(pos);
+                if (s->sequence.load(std::memory_order_acquire) != pos + 1) {
+                    return std::nullopt;
+                }
+                tail->value.store(pos + 1, std::memory_order_relaxed);
+                if (s->length == aborted) {
+                    release_slot(s, pos);
+                    continue;
+                }
+                return Message(this, s, pos);
+            }
+        }
+
+    private:
+        void release_slot(Slot * s, std::uint64_t pos) {
+            s->sequence.store(pos + header->slot_count, std::memory_order_release);
+        }
+    };
+
+    using SpscRing = MessageRing<false>;
+    using MpscRing = MessageRing<true>;
+
+}
@@ -0,0 +1,436 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "msgpackcpp.hpp"
+#include "msgpackcpp_json.hpp"
+#include "msgpackcpp_layout.hpp"
+#include "msgpackcpp_packed.hpp"
+
+#ifdef MSGPACKCPP_WITH_MSGPACK_C
+#include "msgpack.hpp"
+#endif
+
+using namespace msgpackcpp;
+
+namespace {
+    size_t allocations = 0;
+
+    template <class T>
+    void keep(T const & value) {
+        asm volatile("" : : "g"(&value) : "memory");
+    }
+
+    struct Result {
+        std::string name;
+        std::string op;
+        size_t bytes;
+        double mb_per_s;
+        double msg_per_s;
+        // Percentiles of per-batch mean ns/op, not of single calls: timing each call alone would cost more
+        // than many of the calls being timed
+        size_t batch;
+        double batch_ns_p50;
+        double batch_ns_p90;
+        double batch_ns_p99;
+        double allocs;
+    };
+
+    struct Options {
+        double min_time = 0.2;
+        std::string filter;
+        std::string format = "text";
+
+        ~Options();
+    };
+
+    // Defined out of line: main runs once, so its calls are cold and an inline destructor would be copied
+    // into each of its cleanup paths
+    Options::~Options() = default;
+
+    // Times batches of calls into r; each batch gives one mean ns/op sample for the percentiles
+    void measure(const Options & opt, Result & r, const std::function<void()> & f) {
+        using clock = std::chrono::steady_clock;
+        for (int i = 0; i != 100; ++i) {
+            f();
+        }
+        size_t batch = 1;
+        for (;;) {
+            auto b = clock::now();
+            for (size_t i = 0; i != batch; ++i) {
+                f();
+            }
+            if (clock::now() - b > std::chrono::microseconds(50) || batch >= (1u << 20u)) {
+                break;
+            }
+            batch *= 2;
+        }
+
+        std::vector<double> samples;
+        size_t ops = 0;
+        size_t allocs = 0;
+        double total = 0;
+        while (total < opt.min_time || samples.size() < 50) {
+            size_t before = allocations;
+            auto b = clock::now();
+            for (size_t i = 0; i != batch; ++i) {
+                f();
+            }
+            auto e = clock::now();
+            allocs += allocations - before;
+            double seconds = std::chrono::duration<double>(e - b).count();
+            total += seconds;
+            ops += batch;
+            samples.push_back(seconds * 1e9 / static_cast<double>(batch));
+        }
+        std::sort(samples.begin(), samples.end());
+        auto pct = [&samples](double p) {
+            return samples[std::min(samples.size() - 1, static_cast<size_t>(p * static_cast<double>(samples.size())))];
+        };
+        r.msg_per_s = static_cast<double>(ops) / total;
+        r.mb_per_s = r.msg_per_s * static_cast<double>(r.bytes) / 1e6;
+        r.batch = batch;
+        r.batch_ns_p50 = pct(0.5);
+        r.batch_ns_p90 = pct(0.9);
+        r.batch_ns_p99 = pct(0.99);
+        r.allocs = static_cast<double>(allocs) / static_cast<double>(ops);
+    }
+
+    class Suite {
+        const Options & opt;
+        std::vector<Result> results;
+
+        bool wanted(const std::string & name) const {
+            return opt.filter.empty() || name.find(opt.filter) != std::string::npos;
+        }
+
+        // Measured in place, so no Result temporaries are made
+        void run(const std::string & name, const std::string & op, size_t bytes, const std::function<void()> & f) {
+            Result & r = results.emplace_back();
+            r.name = name;
+            r.op = op;
+            r.bytes = bytes;
+            measure(opt, r, f);
+        }
+
+    public:
+        explicit Suite(const Options & opt_) : opt(opt_) { }
+
+        // Encode and decode of one value of type T through a reused buffer
+        template <class T>
+        void value(const std::string & name, const T & value) {
+            if (!wanted(name)) {
+                return;
+            }
+            std::vector<char> buf;
+            OStream os(buf);
+            os << value;
+            size_t bytes = buf.size();
+
+            run(name, "encode", bytes, [&] {
+                buf.clear();
+                OStream out(buf);
+                out << value;
+                keep(buf);
+            });
+
+            T dst{};
+            run(name, "decode", bytes, [&] {
+                IStream is(ConstView(buf.data(), buf.size()));
+                is >> dst;
+                keep(dst);
+            });
+        }
+
+        void custom(const std::string & name, const std::string & op, size_t bytes, const std::function<void()> & f) {
+            if (wanted(name)) {
+                run(name, op, bytes, f);
+            }
+        }
+
+        void print() const {
+            if (opt.format == "csv") {
+                std::printf("name,op,bytes,mb_per_s,msg_per_s,batch,batch_ns_p50,batch_ns_p90,batch_ns_p99,allocs_per_op\n");
+                for (auto & r : results) {
+                    std::printf("%s,%s,%zu,%.3f,%.1f,%zu,%.2f,%.2f,%.2f,%.3f\n", r.name.c_str(), r.op.c_str(), r.bytes,
+                                r.mb_per_s, r.msg_per_s, r.batch, r.batch_ns_p50, r.batch_ns_p90, r.batch_ns_p99, r.allocs);
+                }
+            } else if (opt.format == "json") {
+                std::printf("[\n");
+                for (size_t i = 0; i != results.size(); ++i) {
+                    auto & r = results[i];
+                    std::printf("  {\"name\": \"%s\", \"op\": \"%s\", \"bytes\": %zu, \"mb_per_s\": %.3f, \"msg_per_s\": %.1f, "
+                                "\"batch\": %zu, \"batch_ns_p50\": %.2f, \"batch_ns_p90\": %.2f, \"batch_ns_p99\": %.2f, "
+                                "\"allocs_per_op\": %.3f}%s\n",
+                                r.name.c_str(), r.op.c_str(), r.bytes, r.mb_per_s, r.msg_per_s, r.batch, r.batch_ns_p50,
+                                r.batch_ns_p90, r.batch_ns_p99, r.allocs, i + 1 == results.size() ? "" : ",");
+                }
+                std::printf("]\n");
+            } else {
+                std::printf("%-26s %-7s %8s %10s %12s %8s %9s %9s %9s %7s\n", "name", "op", "bytes", "MB/s", "msg/s",
+                            "batch", "p50 ns", "p90 ns", "p99 ns", "allocs");
+                for (auto & r : results) {
+                    std::printf("%-26s %-7s %8zu %10.1f %12.0f %8zu %9.1f %9.1f %9.1f %7.2f\n", r.name.c_str(), r.op.c_str(),
+                                r.bytes, r.mb_per_s, r.msg_per_s, r.batch, r.batch_ns_p50, r.batch_ns_p90, r.batch_ns_p99,
+                                r.allocs);
+                }
+                std::printf("p50/p90/p99 are percentiles of the mean ns/op over each batch of calls, not of single calls\n");
+            }
+        }
+    };
+
+    void bench_scalars(Suite & suite) {
+        suite.value("int.fixint", 5);
+        suite.value("int.uint8", static_cast<unsigned char>(200));
+        suite.value("int.uint16", static_cast<unsigned short>(50000));
+        suite.value("int.uint32", 4000000000u);
+        suite.value("int.uint64", 1ull << 60u);
+        suite.value("int.int8", static_cast<signed char>(-100));
+        suite.value("int.int16", static_cast<short>(-30000));
+        suite.value("int.int32", -2000000000);
+        suite.value("int.int64", -(1ll << 60u));
+        suite.value("float.f32", 1.25f);
+        suite.value("float.f64", 3.141592653589793);
+        suite.value("bool", true);
+    }
+
+    void bench_blobs(Suite & suite) {
+        for (size_t size : {8, 64, 1024, 65536}) {
+            suite.value("str." + std::to_string(size), std::string(size, 's'));
+            suite.value("bin." + std::to_string(size), std::vector<char>(size, 'b'));
+        }
+    }
+
+    void bench_containers(Suite & suite) {
+        using Nested = std::tuple<std::tuple<int, int, int>, bool, std::string>;
+        suite.value("tuple.nested", Nested(std::make_tuple(1, 1, 1), true, "example"));
+        suite.value("tuple.wide", std::make_tuple(1, 2u, -3ll, 4.5, 5.5f, true, std::string("seven"),
+                                                  std::make_tuple(8, std::string("nine"))));
+
+        constexpr size_t rows = 1024;
+        std::vector<char> table;
+        OStream os(table);
+        os.write_array_header(rows);
+        for (size_t i = 0; i != rows; ++i) {
+            os << std::make_tuple(static_cast<long>(i * 1000), static_cast<double>(i) / 3, std::string("row"));
+        }
+        std::vector<long> ids;
+        std::vector<double> values;
+        std::vector<std::string_view> names;
+        suite.custom("columns.1024", "decode", table.size(), [&] {
+            ids.clear();
+            values.clear();
+            names.clear();
+            IStream is(ConstView(table.data(), table.size()));
+            is.read_columns(ids, values, names);
+            keep(ids);
+        });
+
+        static constexpr KeySet keys("id", "timestamp", "host", "port", "user", "latency", "status", "path");
+        auto record = std::make_tuple(123456, 1700000000ull, std::string("host-17"), 8080, std::string("alice"),
+                                      0.0042, 200, std::string("/api/v1/items"));
+        std::vector<char> buf;
+        OStream out(buf);
+        out.write_struct(keys, record);
+        suite.custom("struct.map8", "encode", buf.size(), [&] {
+            buf.clear();
+            OStream enc(buf);
+            enc.write_struct(keys, record);
+            keep(buf);
+        });
+        auto dst = record;
+        suite.custom("struct.map8", "decode", buf.size(), [&] {
+            IStream is(ConstView(buf.data(), buf.size()));
+            is.read_struct(keys, std::apply([](auto &... f) { return std::tie(f...); }, dst));
+            keep(dst);
+        });
+    }
+
+    // A tick's worth of small messages: one vector each against one batch buffer
+    void bench_batch(Suite & suite) {
+        constexpr size_t messages = 1000;
+        auto message = std::make_tuple(17, std::string("event"), 2.5);
+        std::vector<char> sample;
+        BatchWriter(sample).add(message);
+        suite.custom("batch.separate1000", "encode", sample.size() * messages, [&] {
+            std::vector<std::vector<char>> out(messages);
+            for (auto & buf : out) {
+                OStream os(buf);
+                os << message;
+            }
+            keep(out);
+        });
+        std::vector<char> buf;
+        suite.custom("batch.framed1000", "encode", (sample.size() + 4) * messages, [&] {
+            buf.clear();
+            BatchWriter batch(buf, Framing::LengthPrefixed);
+            for (size_t i = 0; i != messages; ++i) {
+                batch.add(message);
+            }
+            keep(buf);
+        });
+    }
+
+    // Fresh vector per message against buffers recycled through the thread's pool
+    void bench_buffers(Suite & suite) {
+        auto message = std::make_tuple(42, std::string(200, 'm'), std::make_tuple(1.5, true));
+        std::vector<char> sample;
+        OStream os(sample);
+        os << message;
+        suite.custom("buffer.fresh", "encode", sample.size(), [&] {
+            std::vector<char> buf;
+            OStream out(buf);
+            out << message;
+            keep(buf);
+        });
+        suite.custom("buffer.pooled", "encode", sample.size(), [&] {
+            auto buf = BufferPool::local().acquire();
+            buf.stream() << message;
+            keep(buf);
+        });
+    }
+
+    void bench_json(Suite & suite) {
+        static constexpr KeySet keys("id", "timestamp", "host", "message", "latency", "tags");
+        auto record = std::make_tuple(123456, 1700000000ull, std::string("host-17"),
+                                      std::string("GET /api/v1/items?page=2 returned \"ok\" after retry\n"), 0.0042,
+                                      std::make_tuple(std::string("edge"), std::string("eu-west"), 3));
+        std::vector<char> buf;
+        OStream os(buf);
+        os.write_struct(keys, record);
+        std::string json;
+        to_json(ConstView(buf.data(), buf.size()), json);
+        suite.custom("json.from_msgpack", "encode", buf.size(), [&] {
+            json.clear();
+            to_json(ConstView(buf.data(), buf.size()), json);
+            keep(json);
+        });
+        std::vector<char> out;
+        suite.custom("json.to_msgpack", "decode", json.size(), [&] {
+            out.clear();
+            OStream enc(out);
+            from_json(json, enc);
+            keep(out);
+        });
+    }
+
+    // Sorted timestamps as a plain array against the packed extension
+    void bench_packed(Suite & suite) {
+        std::vector<unsigned long long> ts;
+        for (unsigned long long i = 0, t = 1700000000000ull; i != 4096; ++i, t += 1000 + i % 7) {
+            ts.push_back(t);
+        }
+        for (bool compress : {false, true}) {
+            std::string name = compress ? "packed.ts4096" : "plain.ts4096";
+            std::vector<char> buf;
+            OStream os(buf);
+            os << packed(ts, compress);
+            suite.custom(name, "encode", buf.size(), [&] {
+                buf.clear();
+                OStream enc(buf);
+                enc << packed(ts, compress);
+                keep(buf);
+            });
+            std::vector<unsigned long long> dst;
+            suite.custom(name, "decode", buf.size(), [&] {
+                IStream is(ConstView(buf.data(), buf.size()));
+                is >> packed(dst);
+                keep(dst);
+            });
+        }
+    }
+
+    // The same row decoded through IStream and through a warmed-up LayoutCache
+    void bench_layout(Suite & suite) {
+        using Row = std::tuple<long, unsigned long long, double, bool, std::string_view, std::tuple<int, int, int>, float>;
+        Row src(123456789, 1700000000123ull, 0.25, true, "host-17", std::make_tuple(1, -2, 300), 1.5f);
+        std::vector<char> buf;
+        OStream os(buf);
+        os << src;
+        Row dst;
+        suite.custom("layout.row7", "decode", buf.size(), [&] {
+            IStream is(ConstView(buf.data(), buf.size()));
+            is >> dst;
+            keep(dst);
+        });
+        LayoutCache<Row> cache;
+        suite.custom("layout.row7.cached", "decode", buf.size(), [&] {
+            cache.decode(ConstView(buf.data(), buf.size()), dst);
+            keep(dst);
+        });
+    }
+
+#ifdef MSGPACKCPP_WITH_MSGPACK_C
+    void bench_msgpack_c(Suite & suite) {
+        using Src = msgpack::type::tuple<msgpack::type::tuple<int, int, int>, bool, std::string>;
+        Src src(msgpack::type::make_tuple(1, 1, 1), true, "example");
+        msgpack::sbuffer sbuf;
+        msgpack::pack(sbuf, src);
+        suite.custom("msgpack-c.tuple.nested", "encode", sbuf.size(), [&] {
+            sbuf.clear();
+            msgpack::pack(sbuf, src);
+            keep(sbuf);
+        });
+        Src dst;
+        suite.custom("msgpack-c.tuple.nested", "decode", sbuf.size(), [&] {
+            msgpack::object_handle oh = msgpack::unpack(sbuf.data(), sbuf.size());
+            oh.get().convert(dst);
+            keep(dst);
+        });
+    }
+#endif
+}
+
+void * operator new(size_t n) {
+    ++allocations;
+    if (void * p = std::malloc(n == 0 ? 1 : n)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void * p) noexcept {
+    std::free(p);
+}
+
+void operator delete(void * p, size_t) noexcept {
+    std::free(p);
+}
+
+int main(int argc, char ** argv) {
+    Options opt;
+    for (int i = 1; i != argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--format=", 0) == 0) {
+            opt.format = arg.substr(9);
+        } else if (arg.rfind("--filter=", 0) == 0) {
+            opt.filter = arg.substr(9);
+        } else if (arg.rfind("--min-time=", 0) == 0) {
+            opt.min_time = std::stod(arg.substr(11));
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--format=text|csv|json] [--filter=substring] [--min-time=seconds]" << std::endl;
+            return 1;
+        }
+    }
+
+    Suite suite(opt);
+    bench_scalars(suite);
+    bench_blobs(suite);
+    bench_containers(suite);
+    bench_buffers(suite);
+    bench_batch(suite);
+    bench_json(suite);
+    bench_packed(suite);
+    bench_layout(suite);
+#ifdef MSGPACKCPP_WITH_MSGPACK_C
+    bench_msgpack_c(suite);
+#endif
+    suite.print();
+}
@@ -0,0 +1,230 @@
+#include <iostream>
+#include <string>
+
+#include <sys/socket.h>
+
+#include "msgpackcpp_async.hpp"
+
+using namespace msgpackcpp;
+
+using Request = std::tuple<int, std::string>;
+
+Task<void> serve(EventLoop & loop, int fd, size_t & served) {
+    AsyncReader reader(loop, fd);
+    AsyncWriter writer(loop, fd);
+    while (auto request = co_await reader.next<Request>()) {
+        auto & [n, text] = *request;
+        co_await writer.send(std::make_tuple(n + 1, text + "!"));
+        ++served;
+    }
+    loop.forget(fd);
+    ::close(fd);
+}
+
+Task<void> client(EventLoop & loop, int fd, int id, size_t & finished) {
+    AsyncReader reader(loop, fd);
+    AsyncWriter writer(loop, fd);
+    for (int i = 0; i != 20; ++i) {
+        co_await writer.send(std::make_tuple(id * 100 + i, std::string(i * 10, 'x')));
+        auto reply = co_await reader.next<Request>();
+        if (!reply || std::get<0>(*reply) != id * 100 + i + 1 || std::get<1>(*reply) != std::string(i * 10, 'x') + "!") {
+            throw std::runtime_error("Async test failed");
+        }
+    }
+    ::shutdown(fd, SHUT_WR);
+    if (co_await reader.next<Request>()) {
+        throw std::runtime_error("Async test failed");
+    }
+    loop.forget(fd);
+    ::close(fd);
+    ++finished;
+}
+
+void check_many_connections() {
+    constexpr int connections = 500;
+    EventLoop loop;
+    size_t served = 0, finished = 0;
+    for (int i = 0; i != connections; ++i) {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            throw std::runtime_error("socketpair failed");
+        }
+        set_nonblocking(fds[0]);
+        set_nonblocking(fds[1]);
+        loop.spawn(serve(loop, fds[0], served));
+        loop.spawn(client(loop, fds[1], i, finished));
+    }
+    loop.run();
+    if (served != connections * 20 || finished != connections) {
+        throw std::runtime_error("Async test failed");
+    }
+}
+
+void check_large_message() {
+    EventLoop loop;
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw std::runtime_error("socketpair failed");
+    }
+    set_nonblocking(fds[0]);
+    set_nonblocking(fds[1]);
+    std::string big(1 << 20, 'b');
+    bool received = false;
+    auto sender = [](EventLoop & loop, int fd, std::string payload) -> Task<void> {
+        AsyncWriter writer(loop, fd);
+        co_await writer.send(payload);
+        loop.forget(fd);
+        ::close(fd);
+    };
+    auto receiver = [](EventLoop & loop, int fd, const std::string & expected, bool & ok) -> Task<void> {
+        AsyncReader reader(loop, fd);
+        auto value = co_await reader.next<std::string>();
+        ok = value && *value == expected && !co_await reader.next<std::string>();
+        loop.forget(fd);
+        ::close(fd);
+    };
+    loop.spawn(sender(loop, fds[0], big));
+    loop.spawn(receiver(loop, fds[1], big, received));
+    loop.run();
+    if (!received) {
+        throw std::runtime_error("Async test failed");
+    }
+}
+
+void check_truncated() {
+    EventLoop loop;
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw std::runtime_error("socketpair failed");
+    }
+    set_nonblocking(fds[1]);
+    ::write(fds[0], "\x92\x01", 2);
+    ::close(fds[0]);
+    auto receiver = [](EventLoop & loop, int fd) -> Task<void> {
+        AsyncReader reader(loop, fd);
+        co_await reader.next<std::tuple<int, int>>();
+    };
+    std::exception_ptr error;
+    loop.on_task_error([&error](std::exception_ptr e) { error = e; });
+    loop.spawn(receiver(loop, fds[1]));
+    loop.run();
+    try {
+        std::rethrow_exception(error);
+    } catch (const EOFError &) {
+    }
+    ::close(fds[1]);
+}
+
+void check_message_limit() {
+    EventLoop loop;
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw std::runtime_error("socketpair failed");
+    }
+    set_nonblocking(fds[1]);
+    // A str32 header announcing 1 MiB, followed by more than the reader allows
+    std::string data("\xdb\x00\x10\x00\x00", 5);
+    data.append(70000, 's');
+    if (::write(fds[0], data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+        throw std::runtime_error("write failed");
+    }
+    auto receiver = [](EventLoop & loop, int fd) -> Task<void> {
+        AsyncReader reader(loop, fd, 4096, 1u << 16u);
+        co_await reader.next<std::string>();
+    };
+    std::exception_ptr error;
+    loop.on_task_error([&error](std::exception_ptr e) { error = e; });
+    loop.spawn(receiver(loop, fds[1]));
+    loop.run();
+    try {
+        std::rethrow_exception(error);
+    } catch (const LimitError &) {
+    }
+    ::close(fds[0]);
+    ::close(fds[1]);
+}
+
+// One connection failing leaves the others on the loop running
+void check_failure_isolated() {
+    EventLoop loop;
+    int bad[2], good[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, bad) != 0 || ::socketpair(AF_UNIX, SOCK_STREAM, 0, good) != 0) {
+        throw std::runtime_error("socketpair failed");
+    }
+    for (int fd : {bad[1], good[0], good[1]}) {
+        set_nonblocking(fd);
+    }
+    // 0xc1 is no msgpack format at all
+    ::write(bad[0], "\xc1", 1);
+    auto receiver = [](EventLoop & loop, int fd) -> Task<void> {
+        AsyncReader reader(loop, fd);
+        co_await reader.next<int>();
+    };
+    size_t served = 0, finished = 0;
+    std::exception_ptr error;
+    loop.on_task_error([&error](std::exception_ptr e) { error = e; });
+    loop.spawn(receiver(loop, bad[1]));
+    loop.spawn(serve(loop, good[0], served));
+    loop.spawn(client(loop, good[1], 1, finished));
+    loop.run();
+    if (loop.failed_tasks() != 1 || served != 20 || finished != 1) {
+        throw std::runtime_error("Async test failed");
+    }
+    try {
+        std::rethrow_exception(error);
+    } catch (const TypeError &) {
+    }
+    ::close(bad[0]);
+    ::close(bad[1]);
+}
+
+// Concurrent sends through one writer are serialized, each message whole and in order
+void check_concurrent_sends() {
+    EventLoop loop;
+    int fds[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        throw std::runtime_error("socketpair failed");
+    }
+    set_nonblocking(fds[0]);
+    set_nonblocking(fds[1]);
+    AsyncWriter writer(loop, fds[0]);
+    int senders = 2;
+    auto sender = [](EventLoop & loop, AsyncWriter & writer, int fd, int id, int & senders) -> Task<void> {
+        for (int i = 0; i != 4; ++i) {
+            co_await writer.send(std::make_tuple(id, std::string(300000, static_cast<char>('a' + id))));
+        }
+        if (--senders == 0) {
+            loop.forget(fd);
+            ::close(fd);
+        }
+    };
+    std::vector<int> order;
+    auto receiver = [](EventLoop & loop, int fd, std::vector<int> & order) -> Task<void> {
+        AsyncReader reader(loop, fd);
+        while (auto message = co_await reader.next<Request>()) {
+            auto & [id, text] = *message;
+            if (text != std::string(300000, static_cast<char>('a' + id))) {
+                throw std::runtime_error("Async test failed");
+            }
+            order.push_back(id);
+        }
+        loop.forget(fd);
+        ::close(fd);
+    };
+    loop.spawn(sender(loop, writer, fds[0], 0, senders));
+    loop.spawn(sender(loop, writer, fds[0], 1, senders));
+    loop.spawn(receiver(loop, fds[1], order));
+    loop.run();
+    if (loop.failed_tasks() != 0 || order.size() != 8) {
+        throw std::runtime_error("Async test failed");
+    }
+}
+
+int main() {
+    check_many_connections();
+    check_large_message();
+    check_truncated();
+    check_message_limit();
+    check_failure_isolated();
+    check_concurrent_sends();
+}
@@ -1,5 +1,9 @@
 #include <iostream>
 #include "msgpackcpp.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include <thread>
 #include <vector>
 
 using namespace msgpackcpp;
@@ -68,10 +72,774 @@ void check_array() {
     check(t1);
 }
 
+void check_double_widths() {
+    for (double x : {0.0, 1.5, -1e300, 3.141592653589793}) {
+        check(x);
+    }
+    check(-5l);
+    check(1ul << 40u);
+}
+
+void check_columns() {
+    using Row = std::tuple<long, double, std::string>;
+    std::vector<char> data;
+    OStream os(data);
+    os << std::make_tuple(Row{1, 0.5, "a"}, Row{-2, 1.5, "bb"}, Row{1ll << 40, -2.0, "ccc"});
+
+    columns_t<Row> cols;
+    ConstView cv(data.data(), data.size());
+    IStream is(cv);
+    is.read_columns(cols);
+    if (std::get<0>(cols) != std::vector<long>{1, -2, 1ll << 40} ||
+        std::get<1>(cols) != std::vector<double>{0.5, 1.5, -2.0} ||
+        std::get<2>(cols) != std::vector<std::string>{"a", "bb", "ccc"}) {
+        throw std::runtime_error("Columns test failed");
+    }
+
+    std::vector<int> ids;
+    std::vector<bool> flags;
+    std::vector<std::string_view> names;
+    data.clear();
+    os << std::make_tuple(std::make_tuple(7, true, std::string("x")), std::make_tuple(8, false, std::string("yz")));
+    IStream is2(ConstView(data.data(), data.size()));
+    is2.read_columns(ids, flags, names);
+    if (ids != std::vector<int>{7, 8} || flags != std::vector<bool>{true, false} ||
+        names != std::vector<std::string_view>{"x", "yz"}) {
+        throw std::runtime_error("Columns test failed");
+    }
+
+    data.clear();
+    os << std::make_tuple(std::make_tuple(1, 2));
+    IStream is3(ConstView(data.data(), data.size()));
+    try {
+        is3.read_columns(ids, flags, names);
+        throw std::runtime_error("Columns test failed");
+    } catch (const LengthError &) {
+    }
+
+    // A row failing halfway leaves the rows before it and nothing of its own
+    std::vector<char> partial;
+    OStream os4(partial);
+    os4 << std::make_tuple(std::make_tuple(9, true, std::string("a")), std::make_tuple(10, false, 11));
+    IStream is4(ConstView(partial.data(), partial.size()));
+    names.clear();
+    try {
+        is4.read_columns(ids, flags, names);
+        throw std::runtime_error("Columns test failed");
+    } catch (const TypeError &) {
+    }
+    if (ids != std::vector<int>{7, 8, 9} || flags != std::vector<bool>{true, false, true} ||
+        names != std::vector<std::string_view>{"a"}) {
+        throw std::runtime_error("Columns test failed");
+    }
+}
+
+void check_long_strings() {
+    for (size_t size : {31, 32, 127, 128, 200, 255, 256, 70000}) {
+        check(std::string(size, 'x'));
+        check(std::vector<char>(size, 'y'));
+    }
+}
+
+void check_struct() {
+    static constexpr KeySet keys("id", "name", "score", "tags");
+    static_assert(keys.find("score") == 2);
+    static_assert(keys.find("missing") == keys.size());
+
+    std::vector<char> data;
+    OStream os(data);
+    os.write_map_header(5);
+    os << "score" << 2.5 << "extra" << std::make_tuple(1, std::string("skip me"), 3.0f);
+    os << "name" << "bob" << "id" << 42 << "tags" << std::vector<char>{'a', 'b'};
+
+    int id = 0;
+    std::string name;
+    double score = 0;
+    std::vector<char> tags;
+    ConstView cv(data.data(), data.size());
+    IStream is(cv);
+    is.read_struct(keys, std::tie(id, name, score, tags));
+    if (id != 42 || name != "bob" || score != 2.5 || tags != std::vector<char>{'a', 'b'}) {
+        throw std::runtime_error("Struct test failed");
+    }
+
+    data.clear();
+    os.write_struct(keys, std::make_tuple(7, std::string("eve"), 1.0, std::vector<char>{}));
+    int id2 = 0;
+    std::string name2;
+    double score2 = 0;
+    std::vector<char> tags2{'z'};
+    IStream is2(ConstView(data.data(), data.size()));
+    is2.read_struct(keys, std::tie(id2, name2, score2, tags2));
+    if (id2 != 7 || name2 != "eve" || score2 != 1.0 || !tags2.empty()) {
+        throw std::runtime_error("Struct test failed");
+    }
+}
+
+void check_interning() {
+    std::vector<char> data;
+    OStream os(data);
+    for (int i = 0; i != 3; ++i) {
+        os.write_map_header(2);
+        os << "host" << i << "port" << i;
+    }
+
+    KeyInterner interner;
+    IStream is(ConstView(data.data(), data.size()));
+    std::vector<unsigned int> ids;
+    const char * first_host = nullptr;
+    for (int i = 0; i != 3; ++i) {
+        size_t size = is.read_map_header();
+        for (size_t j = 0; j != size; ++j) {
+            auto key = is.read_key(interner);
+            if (key.name == "host") {
+                if (first_host == nullptr) {
+                    first_host = key.name.data();
+                } else if (first_host != key.name.data()) {
+                    throw std::runtime_error("Interning test failed");
+                }
+            }
+            ids.push_back(key.id);
+            is.skip();
+        }
+    }
+    if (interner.size() != 2 || ids != std::vector<unsigned int>{0, 1, 0, 1, 0, 1} || interner.name(1) != "port") {
+        throw std::runtime_error("Interning test failed");
+    }
+}
+
+void check_patch() {
+    static constexpr KeySet keys("hops", "ts", "body");
+    std::vector<char> data;
+    OStream os(data);
+    os.write_array_header(2);
+    os << 1000000;
+    os.write_struct(keys, std::make_tuple(3, 1.5, std::string("payload")));
+
+    auto read_back = [&data](int & hops, double & ts, int & route) {
+        std::string body;
+        IStream is(ConstView(data.data(), data.size()));
+        is.read_array_header();
+        is >> route;
+        is.read_struct(keys, std::tie(hops, ts, body));
+    };
+
+    Editor ed(MutableView(data.data(), data.size()));
+    if (ed.set({1, "hops"}, 4) != PatchResult::Ok ||
+        ed.set({1, "ts"}, 2.25) != PatchResult::Ok ||
+        ed.set({0}, -7) != PatchResult::Ok) {
+        throw std::runtime_error("Patch test failed");
+    }
+    int hops = 0, route = 0;
+    double ts = 0;
+    read_back(hops, ts, route);
+    if (hops != 4 || ts != 2.25 || route != -7) {
+        throw std::runtime_error("Patch test failed");
+    }
+
+    if (ed.set({1, "hops"}, 1000) != PatchResult::NeedsReencode ||
+        ed.set({1, "missing"}, 1) != PatchResult::NotFound ||
+        ed.set({2}, 1) != PatchResult::NotFound ||
+        ed.set({1, "body"}, 1) != PatchResult::TypeMismatch ||
+        ed.set({0}, 1ll << 40) != PatchResult::NeedsReencode) {
+        throw std::runtime_error("Patch test failed");
+    }
+    read_back(hops, ts, route);
+    if (hops != 4 || route != -7) {
+        throw std::runtime_error("Patch test failed");
+    }
+}
+
+template <class C>
+std::vector<char> canonical(const C & c) {
+    std::vector<char> data;
+    OStream<std::vector<char>, Encoding::Canonical> os(data);
+    os << c;
+    return data;
+}
+
+void check_canonical() {
+    if (canonical(200) != canonical(200u) || canonical(5ll) != canonical(static_cast<unsigned char>(5)) ||
+        canonical(-0.0) != canonical(0.0) || canonical(1.5f) != canonical(1.5) ||
+        canonical(std::make_tuple(1, 2.0)) != canonical(std::make_tuple(1ull, 2.0f)) ||
+        canonical(100) != std::vector<char>{'\x64'} || canonical(-20) != std::vector<char>{'\xec'} ||
+        canonical(0.1).size() != 9) {
+        throw std::runtime_error("Canonical test failed");
+    }
+    for (long long i : {-1ll << 40, -40000ll, -200ll, -33ll, -32ll, 0ll, 127ll, 128ll, 70000ll, 1ll << 40}) {
+        auto data = canonical(i);
+        long long tmp = 0;
+        IStream is(ConstView(data.data(), data.size()));
+        is >> tmp;
+        if (tmp != i) {
+            throw std::runtime_error("Canonical test failed");
+        }
+    }
+    // Canonical floats may come out at either width; both readers take both
+    for (double x : {0.0, -0.0, 1.5, 0.1, -1e300, 3.0e38}) {
+        auto data = canonical(x);
+        double tmp = 1;
+        IStream is(ConstView(data.data(), data.size()));
+        is >> tmp;
+        if (tmp != x) {
+            throw std::runtime_error("Canonical test failed");
+        }
+    }
+    for (float x : {0.0f, 2.5f, 0.1f, -1e30f}) {
+        auto data = canonical(static_cast<double>(x));
+        float tmp = 1;
+        IStream is(ConstView(data.data(), data.size()));
+        is >> tmp;
+        if (tmp != x) {
+            throw std::runtime_error("Canonical test failed");
+        }
+    }
+    auto nan = canonical(std::numeric_limits<double>::quiet_NaN());
+    double nan_back = 0;
+    IStream nan_is(ConstView(nan.data(), nan.size()));
+    nan_is >> nan_back;
+    auto wide = canonical(0.1);
+    float narrow = 0;
+    IStream wide_is(ConstView(wide.data(), wide.size()));
+    if (nan_back == nan_back || wide_is.try_read(narrow)) {
+        throw std::runtime_error("Canonical test failed");
+    }
+    try {
+        wide_is >> narrow;
+        throw std::runtime_error("Canonical test failed");
+    } catch (const TypeError &) {
+    }
+
+    static constexpr KeySet keys("zeta", "alpha", "mid");
+    std::vector<char> a, b;
+    OStream<std::vector<char>, Encoding::Canonical> osa(a);
+    osa.write_struct(keys, std::make_tuple(1, 2, 3));
+    OStream<std::vector<char>, Encoding::Canonical> osb(b);
+    osb.write_map_header(3) << "alpha" << 2 << "mid" << 3 << "zeta" << 1;
+    if (a != b) {
+        throw std::runtime_error("Canonical test failed");
+    }
+}
+
+void check_hash() {
+    auto xxh64 = [](const std::string & s, unsigned long long seed) {
+        std::vector<char> out;
+        HashSink hs(out, seed);
+        for (char c : s) {
+            hs.push_back(c);
+        }
+        return hs.digest();
+    };
+    std::string bytes;
+    for (int i = 0; i != 100; ++i) {
+        bytes.push_back(static_cast<char>(i));
+    }
+    if (xxh64("", 0) != 0xEF46DB3751D8E999ull || xxh64("abc", 0) != 0x44BC2CF5AD770999ull ||
+        xxh64(bytes, 7) != 0x80653E7E9B887CDDull) {
+        throw std::runtime_error("Hash test failed");
+    }
+
+    std::vector<char> data;
+    HashSink hs(data);
+    OStream<HashSink<std::vector<char>>, Encoding::Canonical> os(hs);
+    os << std::make_tuple(1, std::string(40, 'k'), -3.0);
+    if (hs.digest() != xxh64(std::string(data.begin(), data.end()), 0)) {
+        throw std::runtime_error("Hash test failed");
+    }
+}
+
+void check_stats() {
+    std::vector<char> data;
+    OStream<std::vector<char>, Encoding::Compact, Stats> os(data);
+    os << std::make_tuple(1, std::string(40, 's'), std::make_tuple(2.5, std::vector<char>(3, 'b')));
+    auto & enc = os.policy();
+    if (enc.values_by_format[0xdc] != 2 || enc.values_by_format[0x01] != 1 || enc.values_by_format[0xd9] != 1 ||
+        enc.values_by_format[0xcb] != 1 || enc.values_by_format[0xc4] != 1 || enc.bytes(TypeClass::Str) != 42 ||
+        enc.bytes(TypeClass::Array) != 6 || enc.max_depth != 2 || enc.values(TypeClass::Int) != 1) {
+        throw std::runtime_error("Stats test failed");
+    }
+
+    std::tuple<int, std::string, std::tuple<double, std::vector<char>>> dst;
+    IStream<Stats> is(ConstView(data.data(), data.size()));
+    is >> dst;
+    auto dec = is.policy();
+    if (dec.values_by_format != enc.values_by_format || dec.bytes_by_class != enc.bytes_by_class ||
+        dec.allocations != 2 || dec.allocated_bytes != 43 || dec.max_depth != 2) {
+        throw std::runtime_error("Stats test failed");
+    }
+
+    Stats total;
+    total += dec;
+    for (int i = 0; i != 3; ++i) {
+        IStream<Stats> bad(ConstView(data.data(), data.size()));
+        try {
+            std::tuple<int, int> wrong;
+            bad >> wrong;
+        } catch (const LengthError &) {
+        }
+        total += bad.policy();
+    }
+    IStream<Stats> bad(ConstView(data.data(), data.size()));
+    try {
+        std::string s;
+        bad >> s;
+    } catch (const TypeError &) {
+    }
+    IStream<Stats> cut(ConstView(data.data(), 5));
+    try {
+        cut >> dst;
+    } catch (const EOFError &) {
+    }
+    total += bad.policy();
+    total += cut.policy();
+    if (total.length_errors != 3 || total.type_errors != 1 || total.eof_errors != 1 ||
+        total.values_by_format[0xdc] != 2 + 3 + 1 || total.max_depth != 2) {
+        throw std::runtime_error("Stats test failed");
+    }
+}
+
+template <class F>
+void expect_limit(F f, size_t limit) {
+    try {
+        f();
+    } catch (const LimitError & e) {
+        if (e.getLimit() != limit) {
+            throw std::runtime_error("Limits test failed");
+        }
+        return;
+    }
+    throw std::runtime_error("Limits test failed");
+}
+
+void check_limits() {
+    std::vector<char> data;
+    OStream os(data);
+    auto value = std::make_tuple(std::make_tuple(1, 2, 3), std::make_tuple(4, 5, 6), std::string(40, 's'), std::string(40, 't'));
+    os << value;
+    ConstView cv(data.data(), data.size());
+
+    auto dst = value;
+    IStream<Budget<>> unlimited(cv);
+    unlimited >> dst;
+    if (dst != value) {
+        throw std::runtime_error("Limits test failed");
+    }
+
+    Limits depth;
+    depth.max_depth = 1;
+    expect_limit([&] { IStream is(cv, Budget(depth)); is >> dst; }, 1);
+
+    Limits elements;
+    elements.max_elements = 8;
+    expect_limit([&] { IStream is(cv, Budget(elements)); is >> dst; }, 8);
+
+    // String lengths are bytes, not elements
+    elements.max_elements = 10;
+    IStream<Budget<>> counted(cv, Budget(elements));
+    counted >> dst;
+
+    Limits container;
+    container.max_container = 16;
+    expect_limit([&] { IStream is(cv, Budget(container)); is >> dst; }, 16);
+
+    Limits allocated;
+    allocated.max_allocated = 60;
+    IStream<Budget<Stats>> is(cv, Budget<Stats>(allocated));
+    expect_limit([&] { is >> dst; }, 60);
+    if (is.policy().allocations != 1 || is.policy().limit_errors != 1) {
+        throw std::runtime_error("Limits test failed");
+    }
+
+    // A forged length is rejected before anything is reserved
+    const char forged[] = "\x91\xdd\x7f\xff\xff\xff";
+    std::vector<long long> column;
+    expect_limit([&] {
+        IStream is(ConstView(forged, sizeof(forged) - 1), Budget(container));
+        is.read_columns(column);
+    }, 16);
+}
+
+// Records whether the watched allocation has been freed
+std::atomic<const void *> watched{nullptr};
+std::atomic<bool> watched_freed{false};
+
+void watch(const void * p) {
+    watched = p;
+    watched_freed = false;
+}
+
+void * operator new(size_t n) {
+    if (void * p = std::malloc(n == 0 ? 1 : n)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void release(void * p) noexcept {
+    if (p != nullptr && p == watched.load()) {
+        watched_freed = true;
+    }
+    std::free(p);
+}
+
+void operator delete(void * p) noexcept {
+    release(p);
+}
+
+void operator delete(void * p, size_t) noexcept {
+    release(p);
+}
+
+void check_pool() {
+    BufferPool pool(4096);
+    const char * first = nullptr;
+    {
+        auto buf = pool.acquire();
+        buf.stream() << std::make_tuple(1, std::string("pooled"));
+        first = buf.data();
+    }
+    if (pool.cached_buffers() != 1 || pool.cached_bytes() < 256) {
+        throw std::runtime_error("Pool test failed");
+    }
+    {
+        auto buf = pool.acquire(100);
+        if (buf.data() != first || buf.size() != 0) {
+            throw std::runtime_error("Pool test failed");
+        }
+        buf.stream() << std::string(3000, 'x');
+        auto big = pool.acquire(2000);
+        if (big.vector().capacity() < 2000 || pool.cached_buffers() != 0) {
+            throw std::runtime_error("Pool test failed");
+        }
+    }
+    if (pool.cached_bytes() > 4096 || pool.cached_buffers() != 1) {
+        throw std::runtime_error("Pool test failed");
+    }
+    {
+        auto huge = pool.acquire(10000);
+    }
+    pool.shrink();
+    if (pool.cached_bytes() != 0 || pool.cached_buffers() != 0) {
+        throw std::runtime_error("Pool test failed");
+    }
+
+    auto & local = BufferPool::local();
+    std::vector<char> sent;
+    {
+        auto buf = local.acquire();
+        buf.stream<Encoding::Canonical>() << std::make_tuple(1, 2);
+        sent = buf.detach();
+    }
+    if (sent != std::vector<char>{'\x92', '\x01', '\x02'} || local.cached_buffers() != 0) {
+        throw std::runtime_error("Pool test failed");
+    }
+
+    // A loan destroyed on another thread is freed there instead of racing on this thread's pool
+    auto moved = local.acquire();
+    watch(moved.data());
+    std::thread([buf = std::move(moved)]() mutable {
+        buf.stream() << 1;
+    }).join();
+    if (!watched_freed || local.cached_buffers() != 0 || local.cached_bytes() != 0) {
+        throw std::runtime_error("Pool test failed");
+    }
+
+    // A loan outliving its pool is freed, even though it is destroyed on the pool's thread
+    std::optional<BufferPool> early(std::in_place);
+    std::optional<PooledBuffer> kept(early->acquire());
+    {
+        auto returned = early->acquire();
+    }
+    if (early->cached_buffers() != 1) {
+        throw std::runtime_error("Pool test failed");
+    }
+    early.reset();
+    watch(kept->data());
+    kept.reset();
+    if (!watched_freed) {
+        throw std::runtime_error("Pool test failed");
+    }
+
+    // A loan outliving its thread's local pool is freed after the pool is gone
+    std::thread([] {
+        static thread_local std::optional<PooledBuffer> held;
+        held.emplace(BufferPool::local().acquire());
+        watch(held->data());
+    }).join();
+    if (!watched_freed) {
+        throw std::runtime_error("Pool test failed");
+    }
+}
+
+namespace domain {
+    // Short string stored inline, encoded as a msgpack string
+    class InlineString {
+        char buf[15] = {};
+        unsigned char len = 0;
+
+    public:
+        InlineString() = default;
+
+        explicit InlineString(std::string_view s) : len(static_cast<unsigned char>(s.size())) {
+            std::copy(s.begin(), s.end(), buf);
+        }
+
+        std::string_view view() const {
+            return std::string_view(buf, len);
+        }
+
+        template <class Stream>
+        friend void msgpack_pack(Stream & os, const InlineString & s) {
+            os << s.view();
+        }
+
+        template <class Stream>
+        friend void msgpack_unpack(Stream & is, InlineString & s) {
+            std::string_view v;
+            is >> v;
+            if (v.size() > sizeof(s.buf)) {
+                throw LengthError("String too long for InlineString", v.size(), sizeof(s.buf));
+            }
+            s = InlineString(v);
+        }
+    };
+
+    struct Order {
+        unsigned long long id = 0;
+        InlineString symbol;
+        std::vector<InlineString> tags;
+    };
+
+    template <class Stream>
+    void msgpack_pack(Stream & os, const Order & o) {
+        os.write_array_header(2 + o.tags.size());
+        os << o.id << o.symbol;
+        for (auto & tag : o.tags) {
+            os << tag;
+        }
+    }
+
+    template <class Stream>
+    void msgpack_unpack(Stream & is, Order & o) {
+        size_t size = is.read_array_header();
+        if (size < 2) {
+            throw LengthError("Order too short", size, 2);
+        }
+        is >> o.id >> o.symbol;
+        o.tags.resize(size - 2);
+        for (auto & tag : o.tags) {
+            is >> tag;
+        }
+    }
+
+    struct Point {
+        int x = 0;
+        int y = 0;
+    };
+
+    template <class Stream>
+    void msgpack_unpack(Stream & is, Point & p) {
+        is >> std::tie(p.x, p.y);
+    }
+}
+
+void check_custom() {
+    domain::Order order{42, domain::InlineString("MSFT"), {domain::InlineString("buy"), domain::InlineString("limit")}};
+    std::vector<char> data;
+    OStream os(data);
+    os << std::make_tuple(order, 7);
+    if (data[3] != '\x94' || data[5] != '\xa4') {
+        throw std::runtime_error("Custom test failed");
+    }
+
+    std::vector<char> canonical;
+    OStream<std::vector<char>, Encoding::Canonical, Stats> cs(canonical);
+    cs << order;
+    if (cs.policy().values_by_format[0xa4] != 1 || canonical.size() != data.size() - 4) {
+        throw std::runtime_error("Custom test failed");
+    }
+
+    domain::Order back;
+    int seven = 0;
+    IStream is(ConstView(data.data(), data.size()));
+    is >> std::tie(back, seven);
+    if (back.id != 42 || back.symbol.view() != "MSFT" || back.tags.size() != 2 || back.tags[1].view() != "limit" ||
+        seven != 7) {
+        throw std::runtime_error("Custom test failed");
+    }
+
+    static_assert(has_msgpack_pack<OStream<std::vector<char>>, domain::Order>::value);
+    static_assert(!has_msgpack_unpack<IStream<>, std::pair<int, int>>::value);
+}
+
+void check_try_read() {
+    std::vector<char> data;
+    OStream os(data);
+    os << 70000 << std::string("name") << std::make_tuple(1, std::string("two"), 3.0) << domain::InlineString("sym");
+    IStream is(ConstView(data.data(), data.size()));
+
+    // 70000 needs a uint32, so narrower types decline it without moving the stream
+    if (is.try_read<short>() || is.try_read<std::string>() || is.try_read<double>() || is.tell() != 0) {
+        throw std::runtime_error("Try read test failed");
+    }
+    auto wide = is.try_read<int>();
+    if (!wide || *wide != 70000) {
+        throw std::runtime_error("Try read test failed");
+    }
+
+    auto cp = is.checkpoint();
+    std::string_view name;
+    if (!is.try_read(name) || name != "name") {
+        throw std::runtime_error("Try read test failed");
+    }
+    is.restore(cp);
+    is >> name;
+
+    // An older layout with two fields, then one with a wrong third field, then the right one
+    size_t before = is.tell();
+    int a = 0;
+    std::string b;
+    std::string c;
+    double d = 0;
+    if (is.try_read(std::tie(a, b)) || is.try_read(std::tie(a, b, c)) || is.tell() != before) {
+        throw std::runtime_error("Try read test failed");
+    }
+    std::tuple<int, std::string, double> row;
+    if (!is.try_read(row) || std::get<1>(row) != "two" || is.try_read(std::tie(a, b, d))) {
+        throw std::runtime_error("Try read test failed");
+    }
+
+    if (is.try_read<long long>() || is.try_read<domain::Order>()) {
+        throw std::runtime_error("Try read test failed");
+    }
+    auto sym = is.try_read<domain::InlineString>();
+    if (!sym || sym->view() != "sym" || is.tell() != data.size() || is.try_read<Nil>()) {
+        throw std::runtime_error("Try read test failed");
+    }
+
+    // A value cut off by the end of data is declined as well
+    IStream cut(ConstView(data.data(), 2));
+    if (cut.try_read<int>() || cut.tell() != 0) {
+        throw std::runtime_error("Try read test failed");
+    }
+
+    // Resumable skipping walks each byte of a message arriving in pieces once
+    std::vector<char> message;
+    OStream mos(message);
+    mos << std::make_tuple(1, std::string(300, 's'), std::make_tuple(2.5, std::vector<char>(70, 'b')), Nil{});
+    size_t walked = 0, missing = 1;
+    for (size_t arrived = 0; arrived <= message.size(); ++arrived) {
+        IStream part(ConstView(message.data() + walked, arrived - walked));
+        bool done = part.try_skip(missing);
+        walked += part.tell();
+        if (done != (arrived == message.size()) || walked > arrived) {
+            throw std::runtime_error("Try read test failed");
+        }
+    }
+    if (walked != message.size() || missing != 0) {
+        throw std::runtime_error("Try read test failed");
+    }
+
+    // A probe that fails inside nested containers leaves the depth budget where it was
+    std::vector<char> nested;
+    OStream nos(nested);
+    nos << std::make_tuple(std::make_tuple(1, std::string("y"))) << std::make_tuple(std::make_tuple(std::make_tuple(1)));
+    Limits shallow;
+    shallow.max_depth = 2;
+    IStream<Budget<>> bounded(ConstView(nested.data(), nested.size()), Budget(shallow));
+    std::tuple<domain::Point> wrapped;
+    if (bounded.try_read(wrapped) || bounded.tell() != 0) {
+        throw std::runtime_error("Try read test failed");
+    }
+    bounded.skip();
+    std::tuple<std::tuple<std::tuple<int>>> deep;
+    try {
+        bounded >> deep;
+    } catch (const LimitError &) {
+        return;
+    }
+    throw std::runtime_error("Try read test failed");
+}
+
+void check_batch() {
+    std::vector<char> buf{'x', 'y'};
+    BatchWriter batch(buf, Framing::LengthPrefixed);
+    for (int i = 0; i != 100; ++i) {
+        batch.add(std::make_tuple(i, std::string(static_cast<size_t>(i), 'm')));
+    }
+    batch.add_with([](auto & os) {
+        os.write_map_header(1);
+        os << std::string("k") << 1.5;
+    });
+    try {
+        batch.add_with([](auto & os) {
+            os.write_array_header(2);
+            throw std::runtime_error("producer gave up");
+        });
+    } catch (const std::runtime_error &) {
+    }
+    if (batch.size() != 101 || buf[0] != 'x' || batch.data().size != buf.size() - 2) {
+        throw std::runtime_error("Batch test failed");
+    }
+
+    // Slices from the table and frames from the prefixes agree
+    FramedReader frames(batch.data());
+    for (size_t i = 0; i != batch.size(); ++i) {
+        auto frame = frames.next();
+        auto slice = batch.message(i);
+        if (!frame || frame->data != slice.data || frame->size != slice.size || batch.entries()[i].length != slice.size) {
+            throw std::runtime_error("Batch test failed");
+        }
+        if (i < 100) {
+            int n = -1;
+            std::string_view text;
+            IStream is(slice);
+            is >> std::tie(n, text);
+            if (n != static_cast<int>(i) || text.size() != i || is.tell() != slice.size) {
+                throw std::runtime_error("Batch test failed");
+            }
+        }
+    }
+    if (frames.next()) {
+        throw std::runtime_error("Batch test failed");
+    }
+
+    FramedReader cut(ConstView(batch.data().data, 10));
+    cut.next();
+    try {
+        cut.next();
+        throw std::runtime_error("Batch test failed");
+    } catch (const EOFError &) {
+    }
+
+    batch.clear();
+    std::vector<char> plain;
+    BatchWriter<Encoding::Canonical> unframed(plain);
+    unframed.add(1).add(std::string("two")).add(std::make_tuple(3));
+    if (batch.size() != 0 || buf.size() != 2 || plain != std::vector<char>{'\x01', '\xa3', 't', 'w', 'o', '\x91', '\x03'} ||
+        unframed.entries()[2].offset != 5) {
+        throw std::runtime_error("Batch test failed");
+    }
+}
+
 int main() {
     check_int();
     check_string();
     check_bin();
     check_float();
     check_array();
+    check_double_widths();
+    check_columns();
+    check_long_strings();
+    check_struct();
+    check_interning();
+    check_patch();
+    check_canonical();
+    check_hash();
+    check_stats();
+    check_limits();
+    check_pool();
+    check_custom();
+    check_try_read();
+    check_batch();
 }
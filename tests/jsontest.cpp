@@ -0,0 +1,151 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "msgpackcpp_json.hpp"
+
+using namespace msgpackcpp;
+
+std::string json_of(const std::vector<char> & data) {
+    std::string out;
+    to_json(ConstView(data.data(), data.size()), out);
+    return out;
+}
+
+void check_to_json() {
+    std::vector<char> data;
+    OStream os(data);
+    os.write_map_header(3);
+    os << std::string("ids") << std::make_tuple(1, -2, 300000u, 1ll << 40);
+    os << std::string("text") << std::string("quote \" slash \\ tab \t bell \x07 and a long clean tail of text");
+    os << 7 << std::make_tuple(1.5, 2.0f, true, Nil{}, std::vector<char>{'a', 'b', 'c', 'd'});
+    auto expected = "{\"ids\":[1,-2,300000,1099511627776],"
+                    "\"text\":\"quote \\\" slash \\\\ tab \\t bell \\u0007 and a long clean tail of text\","
+                    "\"7\":[1.5,2.0,true,null,\"YWJjZA==\"]}";
+    if (json_of(data) != expected) {
+        throw std::runtime_error("To json test failed");
+    }
+
+    const char ext[] = "\xd6\x05\x01\x02\x03\x04";
+    std::vector<char> out;
+    to_json(ConstView(ext, sizeof(ext) - 1), out);
+    if (std::string(out.begin(), out.end()) != "{\"type\":5,\"data\":\"AQIDBA==\"}") {
+        throw std::runtime_error("To json test failed");
+    }
+
+    std::vector<char> nested;
+    OStream ns(nested);
+    ns << std::make_tuple(std::make_tuple(), std::make_tuple(std::make_tuple(1)));
+    if (json_of(nested) != "[[],[[1]]]") {
+        throw std::runtime_error("To json test failed");
+    }
+
+    // Every position of the special character relative to the 16 byte blocks
+    for (size_t at = 0; at != 40; ++at) {
+        std::string s(40, 'x');
+        s[at] = '\n';
+        std::vector<char> one;
+        OStream(one) << s;
+        std::string want = "\"" + std::string(at, 'x') + "\\n" + std::string(39 - at, 'x') + "\"";
+        if (json_of(one) != want) {
+            throw std::runtime_error("To json test failed");
+        }
+    }
+
+    // Binary keys are base64 strings already; extension keys have no JSON string form
+    std::vector<char> keyed;
+    OStream ks(keyed);
+    ks.write_map_header(1);
+    ks << std::vector<char>{'a', 'b', 'c'} << 1;
+    if (json_of(keyed) != "{\"YWJj\":1}") {
+        throw std::runtime_error("To json test failed");
+    }
+    const char ext_key[] = "\x81\xd4\x05\x01\x01";
+    try {
+        std::string bad;
+        to_json(ConstView(ext_key, sizeof(ext_key) - 1), bad);
+        throw std::runtime_error("To json test failed");
+    } catch (const TypeError &) {
+    }
+
+    std::vector<char> cut(data.begin(), data.end() - 3);
+    try {
+        json_of(cut);
+        throw std::runtime_error("To json test failed");
+    } catch (const EOFError &) {
+    }
+}
+
+void check_from_json() {
+    std::vector<char> data;
+    OStream os(data);
+    from_json(" { \"a\" : [1, -2, 3.25, 1e3, 18446744073709551615, -9223372036854775809], \"b\\u00e9\\n\": "
+              "{\"t\": true, \"f\": false, \"n\": null}, \"emoji\": \"\\ud83d\\ude00\", \"empty\": [] } ", os);
+
+    IStream is(ConstView(data.data(), data.size()));
+    if (is.read_map_header() != 4) {
+        throw std::runtime_error("From json test failed");
+    }
+    std::string key;
+    long long one = 0, minus_two = 0;
+    double quarter = 0, thousand = 0, huge = 0;
+    unsigned long long max = 0;
+    is >> key;
+    if (key != "a" || is.read_array_header() != 6) {
+        throw std::runtime_error("From json test failed");
+    }
+    is >> one >> minus_two >> quarter >> thousand >> max >> huge;
+    if (one != 1 || minus_two != -2 || quarter != 3.25 || thousand != 1000 || max != ~0ull || huge != -9223372036854775809.0) {
+        throw std::runtime_error("From json test failed");
+    }
+    bool t = false, f = true;
+    Nil n;
+    std::string kt, kf, kn;
+    is >> key;
+    if (key != "b\xc3\xa9\n" || is.read_map_header() != 3) {
+        throw std::runtime_error("From json test failed");
+    }
+    is >> kt >> t >> kf >> f >> kn >> n;
+    std::string emoji;
+    is >> key >> emoji;
+    if (!t || f || emoji != "\xf0\x9f\x98\x80") {
+        throw std::runtime_error("From json test failed");
+    }
+    is >> key;
+    if (key != "empty" || is.read_array_header() != 0 || is.tell() != data.size()) {
+        throw std::runtime_error("From json test failed");
+    }
+
+    std::string back;
+    to_json(ConstView(data.data(), data.size()), back);
+    std::vector<char> again;
+    OStream as(again);
+    from_json(back, as);
+    if (again != data) {
+        throw std::runtime_error("From json test failed");
+    }
+
+    // Deep nesting is counted in one pass
+    std::string deep = std::string(3000, '[') + "1, {\"k\": [2, 3]}" + std::string(3000, ']');
+    std::vector<char> encoded;
+    OStream ds(encoded);
+    from_json(deep, ds);
+    if (json_of(encoded) != std::string(3000, '[') + "1,{\"k\":[2,3]}" + std::string(3000, ']')) {
+        throw std::runtime_error("From json test failed");
+    }
+
+    for (auto bad : {"[1, 2", "{\"a\" 1}", "[1,]", "tru", "\"abc", "[1] 2", "", "[\"\\x\"]"}) {
+        std::vector<char> sink;
+        OStream bs(sink);
+        try {
+            from_json(bad, bs);
+            throw std::runtime_error("From json test failed");
+        } catch (const JsonError &) {
+        }
+    }
+}
+
+int main() {
+    check_to_json();
+    check_from_json();
+}
@@ -0,0 +1,110 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "msgpackcpp_layout.hpp"
+
+using namespace msgpackcpp;
+
+using Row = std::tuple<int, std::string, std::tuple<double, bool, unsigned long long>, std::vector<char>, std::string_view, float>;
+
+std::vector<char> encode(int i, size_t text) {
+    std::vector<char> data;
+    OStream os(data);
+    os << std::make_tuple(i, std::string(text, 't'), std::make_tuple(i * 0.5, i % 2 == 0, 1ull << (i & 63)),
+                          std::vector<char>(static_cast<size_t>(i & 3), 'b'), std::string("view"), 1.25f);
+    return data;
+}
+
+void check_hits() {
+    LayoutCache<Row> cache;
+    Row row;
+    // Fix formats vary in value (small ints, fixstr lengths, bools) without changing the shape
+    for (int i = -20; i != 100; ++i) {
+        auto data = encode(i, static_cast<size_t>(i + 20) % 30);
+        size_t used = cache.decode(ConstView(data.data(), data.size()), row);
+        Row expected;
+        IStream is(ConstView(data.data(), data.size()));
+        is >> expected;
+        if (used != data.size() || row != expected) {
+            throw std::runtime_error("Layout hits test failed");
+        }
+    }
+    // Integer widths and the uint64 width split the traffic into a handful of shapes
+    if (cache.hits() < 90 || cache.misses() > 30) {
+        throw std::runtime_error("Layout hits test failed");
+    }
+}
+
+void check_shapes() {
+    LayoutCache<Row, 2> cache;
+    Row row;
+    auto small = encode(1, 3);
+    auto wide = encode(70000, 300);
+    auto other = encode(-3000, 40);
+    for (int round = 0; round != 3; ++round) {
+        cache.decode(ConstView(small.data(), small.size()), row);
+        cache.decode(ConstView(wide.data(), wide.size()), row);
+        if (std::get<0>(row) != 70000 || std::get<1>(row).size() != 300) {
+            throw std::runtime_error("Layout shapes test failed");
+        }
+    }
+    if (cache.misses() != 2 || cache.hits() != 4) {
+        throw std::runtime_error("Layout shapes test failed");
+    }
+    // A third shape evicts the least recently used one
+    cache.decode(ConstView(other.data(), other.size()), row);
+    cache.decode(ConstView(wide.data(), wide.size()), row);
+    cache.decode(ConstView(small.data(), small.size()), row);
+    if (cache.misses() != 4 || std::get<0>(row) != 1) {
+        throw std::runtime_error("Layout shapes test failed");
+    }
+}
+
+void check_malformed() {
+    LayoutCache<Row> cache;
+    Row row;
+    auto data = encode(5, 10);
+    cache.decode(ConstView(data.data(), data.size()), row);
+    // A truncated message leaves the known shape and is reported by the IStream fallback
+    try {
+        cache.decode(ConstView(data.data(), data.size() - 3), row);
+        throw std::runtime_error("Layout malformed test failed");
+    } catch (const EOFError &) {
+    }
+    std::vector<char> wrong;
+    OStream os(wrong);
+    os << std::make_tuple(1, 2);
+    try {
+        cache.decode(ConstView(wrong.data(), wrong.size()), row);
+        throw std::runtime_error("Layout malformed test failed");
+    } catch (const LengthError &) {
+    }
+}
+
+void check_float_widths() {
+    // Canonical writers emit float-exact doubles as float32
+    LayoutCache<std::tuple<double, float>> cache;
+    std::tuple<double, float> row;
+    for (int round = 0; round != 2; ++round) {
+        for (double x : {0.5, 0.1}) {
+            std::vector<char> data;
+            OStream<std::vector<char>, Encoding::Canonical> os(data);
+            os << std::make_tuple(x, static_cast<double>(2.5f));
+            cache.decode(ConstView(data.data(), data.size()), row);
+            if (std::get<0>(row) != x || std::get<1>(row) != 2.5f) {
+                throw std::runtime_error("Layout float widths test failed");
+            }
+        }
+    }
+    if (cache.misses() != 2 || cache.hits() != 2) {
+        throw std::runtime_error("Layout float widths test failed");
+    }
+}
+
+int main() {
+    check_hits();
+    check_shapes();
+    check_malformed();
+    check_float_widths();
+}
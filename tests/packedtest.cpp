@@ -0,0 +1,151 @@
+#include <iostream>
+#include <limits>
+#include <vector>
+
+#include "msgpackcpp_packed.hpp"
+
+using namespace msgpackcpp;
+
+template <class T>
+std::vector<char> encode(const std::vector<T> & values, bool compress = true) {
+    std::vector<char> data;
+    OStream os(data);
+    os << packed(values, compress);
+    return data;
+}
+
+template <class T>
+std::vector<T> decode(const std::vector<char> & data) {
+    std::vector<T> values;
+    IStream is(ConstView(data.data(), data.size()));
+    is >> packed(values);
+    if (is.tell() != data.size()) {
+        throw std::runtime_error("Packed decode test failed");
+    }
+    return values;
+}
+
+template <class T>
+void roundtrip(const std::vector<T> & values) {
+    if (decode<T>(encode(values)) != values || decode<T>(encode(values, false)) != values) {
+        throw std::runtime_error("Packed roundtrip test failed");
+    }
+}
+
+void check_timestamps() {
+    std::vector<unsigned long long> ts;
+    for (unsigned long long i = 0, t = 1700000000000ull; i != 10000; ++i, t += 1000 + i % 7) {
+        ts.push_back(t);
+    }
+    auto packed_data = encode(ts);
+    auto plain = encode(ts, false);
+    // Deltas of 1000..1006 fit in 11 bits
+    if (packed_data.size() > ts.size() * 11 / 8 + 200 || plain.size() < ts.size() * 9) {
+        throw std::runtime_error("Timestamps test failed");
+    }
+    roundtrip(ts);
+}
+
+void check_runs() {
+    std::vector<int> counters(5000, 3);
+    counters.insert(counters.end(), 5000, -7);
+    auto data = encode(counters);
+    if (data.size() > 16) {
+        throw std::runtime_error("Runs test failed");
+    }
+    roundtrip(counters);
+}
+
+void check_edges() {
+    roundtrip(std::vector<int>{});
+    roundtrip(std::vector<int>{42});
+    roundtrip(std::vector<long long>{std::numeric_limits<long long>::min(), std::numeric_limits<long long>::max(), 0, -1,
+                                     std::numeric_limits<long long>::min()});
+    roundtrip(std::vector<unsigned long long>{~0ull, 0, ~0ull, 1ull << 63u});
+    roundtrip(std::vector<short>{-32768, 32767, 0, -1, 5});
+    roundtrip(std::vector<unsigned char>{255, 0, 1, 254});
+
+    // Widths across every block boundary and bit width
+    std::vector<long long> mixed;
+    unsigned long long x = 88172645463325252ull;
+    for (size_t i = 0; i != 1000; ++i) {
+        x ^= x << 13u;
+        x ^= x >> 7u;
+        x ^= x << 17u;
+        mixed.push_back(static_cast<long long>(x >> (i % 64)));
+    }
+    roundtrip(mixed);
+}
+
+void check_errors() {
+    // A count of 2^32 - 1 that six payload bytes cannot hold
+    std::vector<char> forged;
+    OStream fs(forged);
+    fs.write_ext(packed_ints_ext, std::string_view("\x00\xff\xff\xff\xff\x0f", 6));
+    try {
+        decode<int>(forged);
+        throw std::runtime_error("Packed errors test failed");
+    } catch (const LengthError &) {
+    }
+
+    // A single run claiming 2^62 values is refused before anything is allocated
+    std::vector<char> runs;
+    OStream rs(runs);
+    rs.write_ext(packed_ints_ext, std::string_view("\x01\x80\x80\x80\x80\x80\x80\x80\x80\x40\x00\x80\x80\x80\x80\x80\x80\x80\x80\x40", 20));
+    try {
+        decode<int>(runs);
+        throw std::runtime_error("Packed errors test failed");
+    } catch (const LimitError &) {
+    }
+
+    // The cap is per call, covers both forms and is reported to the stream's policy
+    std::vector<int> capped;
+    for (bool compress : {true, false}) {
+        auto many = encode(std::vector<int>(1000, 7), compress);
+        IStream<Stats> cs(ConstView(many.data(), many.size()));
+        try {
+            cs >> packed(capped, true, 100);
+            throw std::runtime_error("Packed errors test failed");
+        } catch (const LimitError &) {
+        }
+        if (cs.policy().limit_errors != 1) {
+            throw std::runtime_error("Packed errors test failed");
+        }
+    }
+
+    auto data = encode(std::vector<int>{1, 2, 3, 4, 5, 6, 7, 8});
+    data.pop_back();
+    data[1] = static_cast<char>(data[1] - 1);
+    try {
+        decode<int>(data);
+        throw std::runtime_error("Packed errors test failed");
+    } catch (const EOFError &) {
+    }
+
+    std::vector<char> other;
+    OStream os(other);
+    os.write_ext(3, "abcd");
+    try {
+        decode<int>(other);
+        throw std::runtime_error("Packed errors test failed");
+    } catch (const TypeError &) {
+    }
+
+    Limits limits;
+    limits.max_container = 100;
+    auto big = encode(std::vector<int>(1000, 1));
+    std::vector<int> dst;
+    IStream is(ConstView(big.data(), big.size()), Budget(limits));
+    try {
+        is >> packed(dst);
+        throw std::runtime_error("Packed errors test failed");
+    } catch (const LimitError &) {
+    }
+}
+
+int main() {
+    check_timestamps();
+    check_runs();
+    check_edges();
+    check_errors();
+}
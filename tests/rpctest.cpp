@@ -0,0 +1,195 @@
+#include <iostream>
+#include <string>
+
+#include <sys/socket.h>
+
+#include "msgpackcpp_rpc.hpp"
+
+using namespace msgpackcpp;
+
+struct Pair {
+    int fds[2];
+
+    Pair() {
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            throw std::runtime_error("socketpair failed");
+        }
+        set_nonblocking(fds[0]);
+        set_nonblocking(fds[1]);
+    }
+};
+
+Task<void> run_server(RpcConnection & server, int fd) {
+    co_await server.serve();
+    ::close(fd);
+}
+
+Task<void> run_client(RpcConnection & client, int fd, size_t & logged_back) {
+    constexpr int calls = 1000;
+    std::vector<Task<int>> replies;
+    for (int i = 0; i != calls; ++i) {
+        replies.push_back(client.call<int>("add", i, 1000));
+    }
+    client.notify("log", std::string("hello"));
+    auto echo = client.call<std::string>("echo", std::string("ping"));
+    auto failing = client.call<int>("fail");
+    auto unknown = client.call<int>("missing", 1);
+    auto nothing = client.call<void>("log", std::string("again"));
+    // Dropped calls forget their entries: one at once, so its response is ignored, and one after its
+    // response has been stored
+    client.call<int>("add", 5, 5);
+    auto never_awaited = client.call<std::string>("echo", std::string("stored"));
+
+    for (int i = calls; i != 0; --i) {
+        if (co_await std::move(replies[i - 1]) != i - 1 + 1000) {
+            throw std::runtime_error("RPC test failed");
+        }
+    }
+    if (co_await std::move(echo) != "ping!") {
+        throw std::runtime_error("RPC test failed");
+    }
+    std::string errors;
+    try {
+        co_await std::move(failing);
+    } catch (const RpcError & e) {
+        errors += e.what();
+    }
+    try {
+        co_await std::move(unknown);
+    } catch (const RpcError & e) {
+        errors += e.what();
+    }
+    if (errors != "boomUnknown method") {
+        throw std::runtime_error("RPC test failed");
+    }
+    co_await std::move(nothing);
+    logged_back = 1;
+
+    ::shutdown(fd, SHUT_WR);
+}
+
+void check_pipelining() {
+    EventLoop loop;
+    Pair pair;
+    RpcConnection server(loop, pair.fds[0]);
+    RpcConnection client(loop, pair.fds[1]);
+
+    std::vector<std::string> log;
+    server.on<std::tuple<int, int>>("add", [](int a, int b) { return a + b; });
+    server.on<std::tuple<std::string>>("echo", [](const std::string & s) { return s + "!"; });
+    server.on<std::tuple<>>("fail", []() -> int { throw std::runtime_error("boom"); });
+    server.on<std::tuple<std::string>>("log", [&log](const std::string & s) { log.push_back(s); });
+
+    size_t done = 0;
+    loop.spawn(run_server(server, pair.fds[0]));
+    loop.spawn(client.serve());
+    loop.spawn(run_client(client, pair.fds[1], done));
+    loop.run();
+    ::close(pair.fds[1]);
+
+    if (done != 1 || log != std::vector<std::string>{"hello", "again"} || client.outstanding_calls() != 0) {
+        throw std::runtime_error("RPC test failed");
+    }
+    // 1005 requests and one notification leave in a handful of writes, not one per message
+    if (client.write_calls() > 20 || server.write_calls() > 20) {
+        throw std::runtime_error("RPC writes were not coalesced");
+    }
+}
+
+void check_closed() {
+    EventLoop loop;
+    Pair pair;
+    RpcConnection client(loop, pair.fds[1]);
+    ::close(pair.fds[0]);
+    bool failed = false;
+    auto caller = [](RpcConnection & client, bool & failed) -> Task<void> {
+        try {
+            co_await client.call<int>("add", 1, 2);
+        } catch (const RpcError &) {
+            failed = true;
+        }
+    };
+    loop.spawn(client.serve());
+    loop.spawn(caller(client, failed));
+    loop.run();
+    ::close(pair.fds[1]);
+    if (!failed || client.outstanding_calls() != 0) {
+        throw std::runtime_error("RPC test failed");
+    }
+}
+
+// The peer reads the request and hangs up before answering; a later call cannot even be sent
+void check_peer_gone_mid_call() {
+    EventLoop loop;
+    Pair pair;
+    RpcConnection client(loop, pair.fds[1]);
+    auto peer = [](EventLoop & loop, int fd) -> Task<void> {
+        co_await loop.readable(fd);
+        char buf[256];
+        ::read(fd, buf, sizeof(buf));
+        loop.forget(fd);
+        ::close(fd);
+    };
+    std::string errors;
+    auto caller = [](RpcConnection & client, std::string & errors) -> Task<void> {
+        try {
+            co_await client.call<int>("add", 1, 2);
+        } catch (const RpcError & e) {
+            errors += e.what();
+        }
+    };
+    loop.spawn(peer(loop, pair.fds[0]));
+    loop.spawn(client.serve());
+    loop.spawn(caller(client, errors));
+    loop.run();
+    if (errors != "Connection closed" || client.outstanding_calls() != 0 || loop.failed_tasks() != 0) {
+        throw std::runtime_error("RPC test failed");
+    }
+    ::close(pair.fds[1]);
+
+    Pair gone;
+    ::close(gone.fds[0]);
+    RpcConnection orphan(loop, gone.fds[1]);
+    errors.clear();
+    loop.spawn(caller(orphan, errors));
+    loop.run();
+    if (errors.find("send") == std::string::npos || orphan.outstanding_calls() != 0 || loop.failed_tasks() != 0) {
+        throw std::runtime_error("RPC test failed");
+    }
+    ::close(gone.fds[1]);
+}
+
+// A garbage frame ends that client's connection, not the server loop serving the others
+void check_garbage_frame() {
+    EventLoop loop;
+    Pair bad, good;
+    RpcConnection bad_server(loop, bad.fds[0]);
+    RpcConnection good_server(loop, good.fds[0]);
+    RpcConnection good_client(loop, good.fds[1]);
+    good_server.on<std::tuple<int, int>>("add", [](int a, int b) { return a + b; });
+    // An array whose message type 7 is not a msgpack-rpc type
+    ::write(bad.fds[1], "\x93\x07\x01\x02", 4);
+
+    int sum = 0;
+    auto caller = [](RpcConnection & client, int fd, int & sum) -> Task<void> {
+        sum = co_await client.call<int>("add", 2, 3);
+        ::shutdown(fd, SHUT_WR);
+    };
+    loop.spawn(run_server(bad_server, bad.fds[0]));
+    loop.spawn(run_server(good_server, good.fds[0]));
+    loop.spawn(good_client.serve());
+    loop.spawn(caller(good_client, good.fds[1], sum));
+    loop.run();
+    if (sum != 5 || loop.failed_tasks() != 0) {
+        throw std::runtime_error("RPC test failed");
+    }
+    ::close(bad.fds[1]);
+    ::close(good.fds[1]);
+}
+
+int main() {
+    check_pipelining();
+    check_closed();
+    check_peer_gone_mid_call();
+    check_garbage_frame();
+}
@@ -0,0 +1,105 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "msgpackcpp_segmented.hpp"
+
+using namespace msgpackcpp;
+
+namespace {
+    struct Point {
+        int x = 0;
+        int y = 0;
+    };
+
+    template <class Stream>
+    void msgpack_unpack(Stream & is, Point & p) {
+        is >> std::tie(p.x, p.y);
+    }
+}
+
+using Message = std::tuple<int, std::string, std::tuple<double, unsigned long long, bool>, std::vector<char>, std::string>;
+
+std::vector<char> sample() {
+    std::vector<char> data;
+    OStream os(data);
+    os << std::make_tuple(-70000, std::string(300, 'a'), std::make_tuple(2.5, 1ull << 40u, true),
+                          std::vector<char>(20, 'b'), std::string("tail"));
+    os << std::make_tuple(3, 4);
+    return data;
+}
+
+void check_every_split() {
+    auto data = sample();
+    for (size_t cut = 0; cut <= data.size(); ++cut) {
+        SegmentedView view{ConstView(data.data(), cut), ConstView(data.data() + cut, data.size() - cut)};
+        SegmentedIStream is(view);
+        Message m;
+        Point p;
+        is >> m >> p;
+        if (std::get<0>(m) != -70000 || std::get<1>(m) != std::string(300, 'a') || std::get<1>(std::get<2>(m)) != (1ull << 40u) ||
+            std::get<3>(m) != std::vector<char>(20, 'b') || std::get<4>(m) != "tail" || p.x != 3 || p.y != 4 ||
+            is.tell() != data.size()) {
+            throw std::runtime_error("Split test failed");
+        }
+        // Only the one value that straddles the cut is copied
+        if (is.stitched_bytes() > 303) {
+            throw std::runtime_error("Split test failed");
+        }
+    }
+}
+
+void check_byte_segments() {
+    auto data = sample();
+    SegmentedView view;
+    for (size_t i = 0; i != data.size(); ++i) {
+        view.add(ConstView(data.data() + i, 1));
+    }
+    SegmentedIStream is(view);
+    is.read_array_header();
+    int i = 0;
+    std::string_view long_text;
+    is >> i >> long_text;
+    is.skip().skip();
+    std::string_view tail;
+    is >> tail;
+    // Stitched views stay valid while the stream lives
+    if (i != -70000 || long_text != std::string(300, 'a') || tail != "tail") {
+        throw std::runtime_error("Byte segments test failed");
+    }
+    is.skip();
+    if (is.tell() != data.size()) {
+        throw std::runtime_error("Byte segments test failed");
+    }
+    try {
+        is.skip();
+        throw std::runtime_error("Byte segments test failed");
+    } catch (const EOFError &) {
+    }
+}
+
+void check_contiguous() {
+    auto data = sample();
+    SegmentedView view{ConstView(data.data(), data.size())};
+    SegmentedIStream is(view);
+    Message m;
+    is >> m;
+    if (is.stitched_bytes() != 0 || std::get<4>(m) != "tail") {
+        throw std::runtime_error("Contiguous test failed");
+    }
+
+    // A string whose length says more than all segments hold
+    SegmentedView cut{ConstView(data.data(), 5), ConstView(data.data() + 5, 20)};
+    SegmentedIStream short_is(cut);
+    try {
+        short_is >> m;
+        throw std::runtime_error("Contiguous test failed");
+    } catch (const EOFError &) {
+    }
+}
+
+int main() {
+    check_every_split();
+    check_byte_segments();
+    check_contiguous();
+}
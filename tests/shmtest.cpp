@@ -0,0 +1,183 @@
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
+
+#include "msgpackcpp_shm.hpp"
+
+using namespace msgpackcpp;
+
+void check_spsc_across_fork() {
+    constexpr size_t slots = 8, slot_size = 64, messages = 10000;
+    auto shm = SharedMemory::create_memfd("spsc", SpscRing::required_size(slots, slot_size));
+    SpscRing::create(shm.data(), shm.size(), slots, slot_size);
+
+    pid_t child = fork();
+    if (child == 0) {
+        auto ring = SpscRing::attach(shm.data(), shm.size());
+        for (size_t i = 0; i != messages;) {
+            auto slot = ring.try_reserve();
+            if (!slot) {
+                std::this_thread::yield();
+                continue;
+            }
+            OStream os(slot->view());
+            os << std::make_tuple(i, std::string("message"));
+            slot->commit();
+            ++i;
+        }
+        _exit(0);
+    }
+
+    auto ring = SpscRing::attach(shm.data(), shm.size());
+    for (size_t i = 0; i != messages;) {
+        auto msg = ring.try_consume();
+        if (!msg) {
+            std::this_thread::yield();
+            continue;
+        }
+        size_t n = 0;
+        std::string_view text;
+        IStream is(msg->view());
+        is >> std::tie(n, text);
+        if (n != i || text != "message") {
+            throw std::runtime_error("SPSC test failed");
+        }
+        ++i;
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 || ring.try_consume()) {
+        throw std::runtime_error("SPSC test failed");
+    }
+}
+
+void check_mpsc() {
+    constexpr size_t slots = 16, slot_size = 32, producers = 4, messages = 5000;
+    auto shm = SharedMemory::create_memfd("mpsc", MpscRing::required_size(slots, slot_size));
+    auto ring = MpscRing::create(shm.data(), shm.size(), slots, slot_size);
+
+    std::vector<std::thread> threads;
+    for (size_t p = 0; p != producers; ++p) {
+        threads.emplace_back([&ring, p] {
+            for (size_t i = 0; i != messages;) {
+                auto slot = ring.try_reserve();
+                if (!slot) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                if (i % 100 == 99) {
+                    ++i;
+                    continue;
+                }
+                OStream os(slot->view());
+                os << std::make_tuple(p, i);
+                slot->commit();
+                ++i;
+            }
+        });
+    }
+
+    std::vector<size_t> next(producers, 0);
+    size_t received = 0;
+    while (received != producers * (messages - messages / 100)) {
+        auto msg = ring.try_consume();
+        if (!msg) {
+            std::this_thread::yield();
+            continue;
+        }
+        size_t p = 0, i = 0;
+        IStream is(msg->view());
+        is >> std::tie(p, i);
+        if (p >= producers || i < next[p] || i % 100 == 99) {
+            throw std::runtime_error("MPSC test failed");
+        }
+        next[p] = i + 1;
+        ++received;
+    }
+    for (auto & t : threads) {
+        t.join();
+    }
+    if (ring.try_consume()) {
+        throw std::runtime_error("MPSC test failed");
+    }
+}
+
+void check_overflow() {
+    auto shm = SharedMemory::create_memfd("small", SpscRing::required_size(2, 8));
+    auto ring = SpscRing::create(shm.data(), shm.size(), 2, 8);
+    auto a = ring.try_reserve();
+    auto b = ring.try_reserve();
+    if (!a || !b || ring.try_reserve()) {
+        throw std::runtime_error("Overflow test failed");
+    }
+    OStream os(a->view());
+    try {
+        os << std::string("longer than eight bytes");
+        throw std::runtime_error("Overflow test failed");
+    } catch (const std::runtime_error & e) {
+        if (std::string(e.what()) != "Not enough space for write") {
+            throw;
+        }
+    }
+}
+
+void check_held_messages() {
+    auto shm = SharedMemory::create_memfd("held", SpscRing::required_size(4, 16));
+    auto ring = SpscRing::create(shm.data(), shm.size(), 4, 16);
+    for (int i = 0; i != 3; ++i) {
+        auto r = ring.try_reserve();
+        OStream os(r->view());
+        os << i;
+        r->commit();
+    }
+    auto first = ring.try_consume();
+    auto second = ring.try_consume();
+    int a = -1, b = -1;
+    IStream(first->view()) >> a;
+    IStream(second->view()) >> b;
+    if (a != 0 || b != 1) {
+        throw std::runtime_error("Held messages test failed");
+    }
+    // Releasing out of order frees the second slot, but producers wrap around to the first
+    second->release();
+    ring.try_reserve()->commit();
+    if (ring.try_reserve()) {
+        throw std::runtime_error("Held messages test failed");
+    }
+    first->release();
+    auto third = ring.try_consume();
+    int c = -1;
+    IStream(third->view()) >> c;
+    if (c != 2 || !ring.try_reserve()) {
+        throw std::runtime_error("Held messages test failed");
+    }
+}
+
+void check_attach_validation() {
+    auto shm = SharedMemory::create_memfd("forged", SpscRing::required_size(4, 16));
+    SpscRing::create(shm.data(), shm.size(), 4, 16);
+    auto * fields = static_cast<std::uint64_t *>(shm.data());
+    // slot_count, then slot_size, follow the magic
+    for (auto forged : {std::make_pair(1, 3ull), std::make_pair(1, 0ull), std::make_pair(1, 1ull << 62),
+                        std::make_pair(2, 1ull << 40), std::make_pair(2, ~0ull)}) {
+        std::uint64_t saved = fields[forged.first];
+        fields[forged.first] = forged.second;
+        try {
+            SpscRing::attach(shm.data(), shm.size());
+            throw std::runtime_error("Attach validation test failed");
+        } catch (const std::invalid_argument &) {
+        }
+        fields[forged.first] = saved;
+    }
+    SpscRing::attach(shm.data(), shm.size());
+}
+
+int main() {
+    check_spsc_across_fork();
+    check_mpsc();
+    check_overflow();
+    check_held_messages();
+    check_attach_validation();
+}
@@ -62,9 +62,40 @@ constexpr auto kek1() {
     return a + b + c + d + e + f + g;
 }
 
+namespace money {
+    // Fixed-point amount in hundredths, encoded as a plain integer
+    struct Cents {
+        long long units = 0;
+    };
+
+    template <class Stream>
+    constexpr void msgpack_pack(Stream & os, const Cents & c) {
+        os << c.units;
+    }
+
+    template <class Stream>
+    constexpr void msgpack_unpack(Stream & is, Cents & c) {
+        is >> c.units;
+    }
+}
+
+constexpr long long custom_roundtrip() {
+    char data[32]{};
+    MutableView mv(data);
+    OStream os(mv);
+    os << std::make_tuple(money::Cents{1999}, money::Cents{-5});
+    ConstView cv(data);
+    IStream is(cv);
+    money::Cents a, b;
+    is >> std::tie(a, b);
+    return a.units + b.units;
+}
+
 int main() {
     ostream_test();
     static_assert(kek1() == 10115);
+    static_assert(custom_roundtrip() == 1994);
+    static_assert(sizeof(IStream<>) == sizeof(ConstView) + sizeof(const char *));
 
 //    kek();
 //    static_assert(sum() == 3);